@@ -0,0 +1,142 @@
+/*
+bench/benchtool.cpp
+Helpers for bench/suite.sh: synthetic canvases too large to ship with the
+repository, and the pixel error of an output against a reference.
+
+  benchtool synth MP dir          writes dir/synth-MPmp-{src,dest,mask}.png
+  benchtool diff ref.png out.png mask.png
+                                  prints the largest and the mean absolute
+                                  difference of the channel values under the
+                                  white pixels of mask
+*/
+
+#include <cmath>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <vector>
+
+#include "../lib/imageio++.h"
+#include "../pixels.h"
+
+/*******************************************************************************
+Synthetic canvases
+*******************************************************************************/
+
+/* Hash of a pixel position, for noise that does not depend on the row order */
+inline unsigned int noise(int x, int y, unsigned int seed)
+{
+  uint32_t h = (uint32_t) x * 0x9e3779b1u ^ (uint32_t) y * 0x85ebca77u ^ seed;
+  h ^= h >> 15;
+  h *= 0x2c1b3c6du;
+  h ^= h >> 12;
+  return h;
+}
+
+inline unsigned char clampByte(double v)
+{
+  return (unsigned char) (v < 0.0 ? 0.0 : v > 255.0 ? 255.0 : v);
+}
+
+/* True if (x, y) of a size x size canvas lies in the mask: a large disc, four
+*  small ones, and a rectangle, about 1.5% of the canvas in six components */
+inline bool inMask(int x, int y, int size)
+{
+  double u = (x + 0.5) / size, v = (y + 0.5) / size;
+  static const double discs[5][3] = {
+    { 0.50, 0.50, 0.050 }, { 0.20, 0.25, 0.020 }, { 0.80, 0.25, 0.020 },
+    { 0.20, 0.75, 0.020 }, { 0.80, 0.75, 0.020 }
+  };
+  for (int k = 0; k < 5; k++) {
+    double du = u - discs[k][0], dv = v - discs[k][1];
+    if (du * du + dv * dv < discs[k][2] * discs[k][2]) return true;
+  }
+  return u > 0.47 && u < 0.53 && v > 0.85 && v < 0.89;
+}
+
+/* Write a square canvas of about mp megapixels: a dest of smooth gradients, a
+*  textured src of the same size to clone at (0, 0), and the mask.  Rows are
+*  encoded as they are made, so that the largest canvases fit in little memory */
+inline int synth(int mp, const char *dir)
+{
+  int size = (int) floor(sqrt(mp * 1.0e6));
+  char prefix[4096];
+  snprintf(prefix, sizeof(prefix), "%s/synth-%dmp-", dir, mp);
+  ImWriter src, dest, mask;
+  if (!src.open(::std::string(prefix) + "src.png", size, size, IM_ENCODE_FASTEST) ||
+      !dest.open(::std::string(prefix) + "dest.png", size, size, IM_ENCODE_FASTEST) ||
+      !mask.open(::std::string(prefix) + "mask.png", size, size, IM_ENCODE_FASTEST)) {
+    return 1;
+  }
+
+  ::std::vector<Color> s(size), d(size), m(size);
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      double u = (double) x / size, v = (double) y / size;
+      d[x].r = clampByte(40 + 160 * u + 8 * sin(40 * v));
+      d[x].g = clampByte(60 + 120 * v + 8 * sin(40 * u));
+      d[x].b = clampByte(200 - 100 * (u + v) / 2);
+      unsigned int n = noise(x, y, 0x5eed);
+      s[x].r = clampByte(128 + 60 * sin(90 * u) * cos(70 * v) + (int) (n & 31) - 16);
+      s[x].g = clampByte(110 + 50 * cos(60 * (u + v)) + (int) ((n >> 8) & 31) - 16);
+      s[x].b = clampByte(90 + 40 * sin(120 * v) + (int) ((n >> 16) & 31) - 16);
+      unsigned char w = inMask(x, y, size) ? 255 : 0;
+      m[x].r = m[x].g = m[x].b = w;
+    }
+    if (!src.writeRow(&s[0]) || !dest.writeRow(&d[0]) || !mask.writeRow(&m[0])) return 1;
+  }
+  return src.close() && dest.close() && mask.close() ? 0 : 1;
+}
+
+/*******************************************************************************
+Pixel error
+*******************************************************************************/
+
+/* Print the largest and the mean absolute difference between the channel
+*  values of ref and out under the white pixels of mask, a row at a time */
+inline int diff(const char *reffilename, const char *outfilename, const char *maskfilename)
+{
+  ImReader ref, out, mask;
+  if (!ref.open(reffilename) || !out.open(outfilename) || !mask.open(maskfilename)) return 1;
+  int W = ref.w(), H = ref.h();
+  if (out.w() != W || out.h() != H || mask.w() != W || mask.h() != H) {
+    fprintf(stderr, "Error: %s, %s and %s differ in size\n", reffilename, outfilename, maskfilename);
+    return 1;
+  }
+
+  ::std::vector<Color> a(W), b(W), m(W);
+  ::std::vector<uint64_t> white((W + 63) / 64 + 1);
+  int maxError = 0;
+  double sum = 0.0;
+  long count = 0;
+  for (int y = 0; y < H; y++) {
+    if (!ref.readRow(&a[0]) || !out.readRow(&b[0]) || !mask.readRow(&m[0])) return 1;
+    whitePixels(&m[0].r, &white[0], W);
+    for (int x = 0; x < W; x++) {
+      if (!bitSet(white, x)) continue;
+      for (int c = 0; c < 3; c++) {
+        int e = abs((int) a[x][c] - (int) b[x][c]);
+        if (e > maxError) maxError = e;
+        sum += e;
+      }
+      count += 3;
+    }
+  }
+  printf("%d %.6f\n", maxError, count ? sum / count : 0.0);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  ::std::string command = argc > 1 ? argv[1] : "";
+  if (command == "synth" && argc == 4) {
+    return synth(atoi(argv[2]), argv[3]);
+  }
+  if (command == "diff" && argc == 5) {
+    return diff(argv[2], argv[3], argv[4]);
+  }
+  fprintf(stderr, "Usage: %s synth MP dir\n", argv[0]);
+  fprintf(stderr, "       %s diff ref.png out.png mask.png\n", argv[0]);
+  return 1;
+}
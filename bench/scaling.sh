@@ -0,0 +1,52 @@
+#!/bin/sh
+# bench/scaling.sh
+# Thread scaling of the solvers on the largest test images.  For each example
+# and solver, reports the best solve time over a few runs with 1, 2, 4, ...
+# threads (up to the number of cores) and the speedup over a single thread.
+#
+# Usage: bench/scaling.sh [max_threads] [runs]
+# Run from the top of the repository after building poisson_clone.
+
+MAX=${1:-$(getconf _NPROCESSORS_ONLN)}
+RUNS=${2:-3}
+BIN=./poisson_clone
+T=./test_images
+OUT=${TMPDIR:-/tmp}/poisson_scaling.png
+
+if [ ! -x $BIN ]; then
+  echo "Build poisson_clone first (make)" >&2
+  exit 1
+fi
+
+# Thread counts: powers of two below MAX, then MAX itself
+COUNTS=""
+n=1
+while [ $n -lt $MAX ]; do
+  COUNTS="$COUNTS $n"
+  n=$((n * 2))
+done
+COUNTS="$COUNTS $MAX"
+
+# Best "Solved all channels" time over RUNS runs of the given arguments
+best() {
+  for r in $(seq $RUNS); do
+    $BIN "$@" 2>/dev/null | sed -n 's/^Solved all channels in \([0-9.]*\) s$/\1/p'
+  done | sort -n | head -1
+}
+
+run() {
+  name=$1
+  shift
+  for solver in "mg" "fmg" "pcg --precond jacobi"; do
+    base=""
+    for t in $COUNTS; do
+      secs=$(best "$@" --solver $solver --threads $t)
+      [ -z "$base" ] && base=$secs
+      echo "$name|$solver|$t|$secs|$base" | awk -F'|' '{ printf "%-10s %-22s %3d threads  %8.3f s  %5.2fx\n", $1, $2, $3, $4, $5 / $4 }'
+    done
+  done
+}
+
+run fig10-il $T/perez-fig10a-src.png $T/perez-fig10a-mask.png $T/perez-fig10a-src.png $OUT 0 0 -il .2 .2
+run fig11-dec $T/perez-fig11-src.png $T/perez-fig11-mask.png $T/perez-fig11-src.png $OUT 0 0 -dec
+run fig6-mx $T/perez-fig6-src.png $T/perez-fig6-mask.png $T/perez-fig6-dst.png $OUT 25 20 -mx
@@ -0,0 +1,124 @@
+#!/bin/sh
+# bench/suite.sh
+# Benchmark suite: the documented examples and synthetic canvases of 4, 16
+# and 64 megapixels, with every solver at 1, 2, 4, ... threads (up to the
+# number of cores).  Each configuration runs a few times and reports its
+# throughput (masked pixels per second at the median time), the median, 90th
+# percentile and slowest wall time of a run, the peak memory, and the largest
+# and mean channel error under the mask against the output of GMRES, the
+# reference solver.  Times and memory are those written by --stats.
+#
+# Usage: bench/suite.sh [runs] [max_threads]
+# Run from the top of the repository; make bench builds poisson_clone and
+# bench/benchtool first.  SIZES lists the synthetic canvas sizes in megapixels
+# ("4 16 64" by default, "" for none) and SOLVERS the solvers to compare.  The
+# results are also kept, one line per configuration, in $WORK/results.txt.
+
+RUNS=${1:-3}
+MAX=${2:-$(getconf _NPROCESSORS_ONLN)}
+SIZES=${SIZES-"4 16 64"}
+SOLVERS=${SOLVERS:-"auto gmres mg fmg pcg fft cholesky"}
+BIN=./poisson_clone
+TOOL=./bench/benchtool
+T=./test_images
+WORK=${WORK:-${TMPDIR:-/tmp}/poisson_bench}
+
+if [ ! -x $BIN ] || [ ! -x $TOOL ]; then
+  echo "Build poisson_clone and bench/benchtool first (make bench)" >&2
+  exit 1
+fi
+mkdir -p $WORK
+RESULTS=$WORK/results.txt
+: > $RESULTS
+
+# Thread counts: powers of two below MAX, then MAX itself
+COUNTS=""
+n=1
+while [ $n -lt $MAX ]; do
+  COUNTS="$COUNTS $n"
+  n=$((n * 2))
+done
+COUNTS="$COUNTS $MAX"
+
+# The value of a field of the stats a run wrote: the first one, so that of
+# the run or of the job rather than of a component
+field() {
+  grep -o "\"$1\": [^,]*" $WORK/stats.json | head -1 | sed 's/.*: //'
+}
+
+# Nearest-rank percentile p of the numbers on stdin
+percentile() {
+  sort -n | awk -v p=$1 '{ v[NR] = $1 } END { i = int((p * NR + 99) / 100); if (i < 1) i = 1; print v[i] }'
+}
+
+printf "%-12s %-9s %7s %9s %9s %9s %9s %9s %8s %9s  %s\n" config solver threads "p50 s" "p90 s" "max s" \
+  "Mpx/s" "peak MB" "max err" "mean err" status | tee -a $RESULTS
+
+# Run one configuration: a name, then src mask dest xOffset yOffset [-FLAG
+# params].  GMRES runs once first for the reference output
+bench() {
+  name=$1
+  shift
+  src=$1 mask=$2 dest=$3 xOff=$4 yOff=$5
+  shift 5
+  ref=$WORK/$name-ref.png
+  out=$WORK/$name-out.png
+  if ! $BIN $src $mask $dest $ref $xOff $yOff "$@" --solver gmres > /dev/null 2>&1; then
+    echo "$name: reference run failed" | tee -a $RESULTS
+    return
+  fi
+  for solver in $SOLVERS; do
+    for t in $COUNTS; do
+      : > $WORK/times.txt
+      status=converged
+      peak=0
+      for r in $(seq $RUNS); do
+        if ! $BIN $src $mask $dest $out $xOff $yOff "$@" --solver $solver --threads $t \
+               --stats $WORK/stats.json > /dev/null 2>&1; then
+          status=failed
+          break
+        fi
+        field seconds >> $WORK/times.txt
+        kb=$(field peak_kb)
+        [ $kb -gt $peak ] && peak=$kb
+        [ "$(field converged)" = "false" ] && status="not converged"
+      done
+      if [ "$status" = failed ]; then
+        printf "%-12s %-9s %7d %s\n" $name $solver $t failed | tee -a $RESULTS
+        continue
+      fi
+      unknowns=$(field unknowns)
+      p50=$(percentile 50 < $WORK/times.txt)
+      p90=$(percentile 90 < $WORK/times.txt)
+      slowest=$(percentile 100 < $WORK/times.txt)
+      error=$($TOOL diff $ref $out $mask)
+      echo "$name $solver $t $p50 $p90 $slowest $unknowns $peak $error" | awk -v status="$status" \
+        '{ printf "%-12s %-9s %7d %9.3f %9.3f %9.3f %9.3f %9.1f %8d %9.4f  %s\n",
+                  $1, $2, $3, $4, $5, $6, $7 / $4 / 1e6, $8 / 1024, $9, $10, status }' | tee -a $RESULTS
+    done
+  done
+}
+
+# The examples of the usage comments and the README (direct cloning has no
+# solve, and fig3b clones into the output of its first layer, so only the
+# first layer is run)
+bench fig3a $T/perez-fig3a-src-orig.png $T/perez-fig3a-mask.png $T/perez-fig3a-dst.png -33 -33
+bench fig3b $T/perez-fig3b-src1-orig.png $T/perez-fig3b-mask1.png $T/perez-fig3b-dst.png 33 24
+bench fig4 $T/perez-fig4a-src-orig.png $T/perez-fig4a-mask.png $T/perez-fig4a-dst.png -11 52
+bench fig4-tex $T/perez-fig4a-src-orig.png $T/perez-fig4a-mask.png $T/perez-fig4a-dst.png -11 52 -tex 10
+bench fig5-mono $T/perez-fig5-src.png $T/perez-fig5-mask.png $T/perez-fig5-dst.png -40 52 -mono
+bench fig6-mx $T/perez-fig6-src.png $T/perez-fig6-mask.png $T/perez-fig6-dst.png 25 20 -mx
+bench fig9-flat $T/perez-fig9-src.png $T/perez-fig9-mask.png $T/perez-fig9-src.png 0 0 -f 5 .95
+bench fig10-il $T/perez-fig10a-src.png $T/perez-fig10a-mask.png $T/perez-fig10a-src.png 0 0 -il .2 .2
+bench fig11-dec $T/perez-fig11-src.png $T/perez-fig11-mask.png $T/perez-fig11-src.png 0 0 -dec
+bench fig11-rec $T/perez-fig11-src.png $T/perez-fig11-mask.png $T/perez-fig11-src.png 0 0 -rec 1.2 0.8 0.8
+bench wash ./custom_images/eisg.png ./custom_images/wash-mask.jpg ./custom_images/wash.jpg 486 300
+
+# Synthetic canvases, made once and kept in $WORK
+for mp in $SIZES; do
+  prefix=$WORK/synth-${mp}mp-
+  if [ ! -f ${prefix}mask.png ]; then
+    $TOOL synth $mp $WORK || { echo "synth-${mp}mp: cannot write canvas" >&2; continue; }
+  fi
+  bench synth-${mp}mp ${prefix}src.png ${prefix}mask.png ${prefix}dest.png 0 0
+done
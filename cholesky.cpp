@@ -0,0 +1,449 @@
+/*
+cholesky.cpp
+Direct sparse Cholesky solver for the Poisson system over Omega: nested
+dissection ordering, up-looking numeric factorization along the elimination
+tree, and the cache file that holds the result.
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gsl/gsl_errno.h>
+
+#include "cholesky.h"
+
+// Boxes of at most this many pixels are ordered row by row rather than split
+static const int DISSECT_LEAF = 64;
+
+// Cache file layout: the header, then Lx, Lp, Li and perm, each starting on
+// an 8-byte boundary so that they can be used in place once mapped
+static const char CACHE_MAGIC[8] = { 'P', 'O', 'I', 'S', 'C', 'H', 'O', 'L' };
+static const uint32_t CACHE_VERSION = 1;
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  int32_t n;
+  uint64_t key;
+  uint64_t nnz;
+};
+
+/* Bytes from the start of a cache file to each of its arrays */
+static size_t align8(size_t bytes)
+{
+  return (bytes + 7) & ~(size_t) 7;
+}
+
+static void cacheLayout(int n, size_t nnz, size_t offsets[5])
+{
+  offsets[0] = align8(sizeof(CacheHeader));                          // Lx
+  offsets[1] = offsets[0] + nnz * sizeof(double);                    // Lp
+  offsets[2] = offsets[1] + ((size_t) n + 1) * sizeof(int64_t);      // Li
+  offsets[3] = align8(offsets[2] + nnz * sizeof(int32_t));           // perm
+  offsets[4] = offsets[3] + (size_t) n * sizeof(int32_t);            // end
+}
+
+/* FNV-1a hash of the structure of A: its size and, per unknown, the status and
+*  Omega ID of each neighbor, which determine every entry */
+static uint64_t structureKey(const Stencil &A)
+{
+  uint64_t h = 14695981039346656037ULL;
+  auto mix = [&](uint32_t v) {
+    for (int byte = 0; byte < 4; byte++) {
+      h ^= (v >> (8 * byte)) & 0xff;
+      h *= 1099511628211ULL;
+    }
+  };
+  mix((uint32_t) A.size());
+  for (int id = 0; id < A.size(); id++) {
+    for (int dir = 0; dir < 4; dir++) {
+      int status = A.status(id, dir);
+      mix((uint32_t) (status + 1));
+      if (status == STENCIL_OMEGA) mix((uint32_t) A.neighbor(id, dir));
+    }
+  }
+  return h;
+}
+
+/* Append the Omega IDs of the pixels in [x0, x1) x [y0, y1) in elimination
+*  order: split the box across its longer side by a line of pixels, which
+*  separates the two halves in the 5-point stencil, order each half, and put
+*  the separator last */
+static void dissect(const Stencil &A, int x0, int y0, int x1, int y1, ::std::vector<int32_t> &order)
+{
+  int W = A.width();
+  const ::std::vector<int> &toOmega = A.omega();
+  if (x1 <= x0 || y1 <= y0) return;
+
+  if ((x1 - x0) * (y1 - y0) <= DISSECT_LEAF || (x1 - x0 < 3 && y1 - y0 < 3)) {
+    for (int y = y0; y < y1; y++) {
+      for (int x = x0; x < x1; x++) {
+        if (toOmega[y * W + x] >= 0) order.push_back(toOmega[y * W + x]);
+      }
+    }
+    return;
+  }
+
+  if (x1 - x0 >= y1 - y0) {
+    int xm = (x0 + x1) / 2;
+    dissect(A, x0, y0, xm, y1, order);
+    dissect(A, xm + 1, y0, x1, y1, order);
+    for (int y = y0; y < y1; y++) {
+      if (toOmega[y * W + xm] >= 0) order.push_back(toOmega[y * W + xm]);
+    }
+  } else {
+    int ym = (y0 + y1) / 2;
+    dissect(A, x0, y0, x1, ym, order);
+    dissect(A, x0, ym + 1, x1, y1, order);
+    for (int x = x0; x < x1; x++) {
+      if (toOmega[ym * W + x] >= 0) order.push_back(toOmega[ym * W + x]);
+    }
+  }
+}
+
+Cholesky::Cholesky(const Stencil &A, const char *cacheDir)
+  : n(A.size()), nnz(0), key(0), Lp(NULL), Li(NULL), Lx(NULL), perm(NULL),
+    mapping(NULL), mappingSize(0)
+{
+  if (n == 0) return;
+  key = structureKey(A);
+
+  ::std::string path;
+  if (cacheDir) {
+    char name[32];
+    snprintf(name, sizeof(name), "/chol-%016llx.bin", (unsigned long long) key);
+    path = ::std::string(cacheDir) + name;
+    if (load(path.c_str(), A)) return;
+  }
+  if (factor(A) && cacheDir) {
+    store(path.c_str());
+  }
+}
+
+Cholesky::~Cholesky()
+{
+  if (mapping) munmap(mapping, mappingSize);
+}
+
+size_t Cholesky::memory() const
+{
+  return nnz * (sizeof(double) + sizeof(int32_t)) + ((size_t) n + 1) * sizeof(int64_t)
+         + (size_t) n * sizeof(int32_t);
+}
+
+/* Up-looking factorization (as in Davis, Direct Methods for Sparse Linear
+*  Systems): row k of L is the solution of a sparse triangular system whose
+*  pattern is the set of nodes reached from the entries of column k of A by
+*  climbing the elimination tree.  A first pass over the same patterns counts
+*  the entries of each column */
+bool Cholesky::factor(const Stencil &A)
+{
+  /* Without a neighbor in dest, rows sum to zero and A is singular */
+  bool anchored = false;
+  for (int id = 0; id < n && !anchored; id++) {
+    for (int dir = 0; dir < 4; dir++) {
+      if (A.status(id, dir) == STENCIL_BOUNDARY) anchored = true;
+    }
+  }
+  if (!anchored) return false;
+
+  /* Elimination order and its inverse */
+  perm_.clear();
+  perm_.reserve(n);
+  dissect(A, 0, 0, A.width(), A.height(), perm_);
+  ::std::vector<int32_t> pos (n);
+  for (int k = 0; k < n; k++) {
+    pos[perm_[k]] = k;
+  }
+
+  /* Upper part of column k of PAP^T: the neighbors in Omega eliminated before
+  *  k, at most four of them */
+  auto upper = [&](int k, int *rows) {
+    int count = 0;
+    for (int dir = 0; dir < 4; dir++) {
+      if (A.status(perm_[k], dir) != STENCIL_OMEGA) continue;
+      int i = pos[A.neighbor(perm_[k], dir)];
+      if (i < k) rows[count++] = i;
+    }
+    return count;
+  };
+
+  /* Elimination tree, with path compression through ancestor */
+  ::std::vector<int32_t> parent (n, -1), ancestor (n, -1);
+  for (int k = 0; k < n; k++) {
+    int rows[4];
+    int count = upper(k, rows);
+    for (int m = 0; m < count; m++) {
+      for (int i = rows[m], next; i != -1 && i < k; i = next) {
+        next = ancestor[i];
+        ancestor[i] = k;
+        if (next == -1) parent[i] = k;
+      }
+    }
+  }
+
+  /* Pattern of row k of L, in topological order in stack[top, n) */
+  ::std::vector<int32_t> flag (n, -1), stack (n);
+  auto reach = [&](int k, const int *rows, int count) {
+    int top = n;
+    flag[k] = k;
+    for (int m = 0; m < count; m++) {
+      int len = 0;
+      int32_t *path = &stack[0];
+      for (int i = rows[m]; flag[i] != k; i = parent[i]) {
+        path[len++] = i;
+        flag[i] = k;
+      }
+      while (len > 0) stack[--top] = path[--len];
+    }
+    return top;
+  };
+
+  /* Symbolic pass: entries per column */
+  Lp_.assign(n + 1, 0);
+  for (int k = 0; k < n; k++) {
+    int rows[4];
+    int count = upper(k, rows);
+    for (int top = reach(k, rows, count); top < n; top++) {
+      Lp_[stack[top] + 1]++;
+    }
+    Lp_[k + 1]++;
+  }
+  for (int k = 0; k < n; k++) {
+    Lp_[k + 1] += Lp_[k];
+  }
+  nnz = (size_t) Lp_[n];
+  Li_.resize(nnz);
+  Lx_.resize(nnz);
+
+  /* Numeric pass; next[j] is the next free slot of column j, whose diagonal
+  *  entry was placed first when row j was done */
+  ::std::fill(flag.begin(), flag.end(), -1);
+  ::std::vector<int64_t> next (Lp_.begin(), Lp_.end() - 1);
+  ::std::vector<double> row (n, 0.0);
+  for (int k = 0; k < n; k++) {
+    int rows[4];
+    int count = upper(k, rows);
+    int top = reach(k, rows, count);
+    for (int m = 0; m < count; m++) {
+      row[rows[m]] = -1.0;
+    }
+    double d = A.diag(perm_[k]);
+    for (; top < n; top++) {
+      int i = stack[top];
+      double lki = row[i] / Lx_[Lp_[i]];
+      row[i] = 0.0;
+      for (int64_t p = Lp_[i] + 1; p < next[i]; p++) {
+        row[Li_[p]] -= Lx_[p] * lki;
+      }
+      d -= lki * lki;
+      int64_t p = next[i]++;
+      Li_[p] = k;
+      Lx_[p] = lki;
+    }
+
+    /* A is positive definite, so this only guards against breakdown */
+    if (d <= 0.0) {
+      ::std::vector<int64_t>().swap(Lp_);
+      ::std::vector<int32_t>().swap(Li_);
+      ::std::vector<double>().swap(Lx_);
+      ::std::vector<int32_t>().swap(perm_);
+      nnz = 0;
+      return false;
+    }
+    int64_t p = next[k]++;
+    Li_[p] = k;
+    Lx_[p] = sqrt(d);
+  }
+
+  Lp = &Lp_[0];
+  Li = &Li_[0];
+  Lx = &Lx_[0];
+  perm = &perm_[0];
+  return true;
+}
+
+/* Map the factor from path if it is the factor of a system with the same key
+*  and size, and checks out as a factor of A */
+bool Cholesky::load(const char *path, const Stencil &A)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(CacheHeader)) {
+    close(fd);
+    return false;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+
+  /* Bound nnz by the file size before the layout is computed from it, so
+  *  that a corrupt count cannot overflow the offsets */
+  const CacheHeader *header = (const CacheHeader *) data;
+  size_t offsets[5];
+  bool fits = header->nnz <= (uint64_t) st.st_size / (sizeof(double) + sizeof(int32_t));
+  if (fits) cacheLayout(n, header->nnz, offsets);
+  if (!fits || memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header->version != CACHE_VERSION
+      || header->key != key || header->n != n || offsets[4] != (size_t) st.st_size) {
+    munmap(data, st.st_size);
+    return false;
+  }
+
+  const char *base = (const char *) data;
+  mapping = data;
+  mappingSize = st.st_size;
+  nnz = header->nnz;
+  Lx = (const double *) (base + offsets[0]);
+  Lp = (const int64_t *) (base + offsets[1]);
+  Li = (const int32_t *) (base + offsets[2]);
+  perm = (const int32_t *) (base + offsets[3]);
+  if (!valid(A)) {
+    fprintf(stderr, "Warning: ignoring corrupt Cholesky cache %s\n", path);
+    munmap(mapping, mappingSize);
+    mapping = NULL;
+    mappingSize = 0;
+    nnz = 0;
+    Lp = NULL;
+    Li = NULL;
+    Lx = NULL;
+    perm = NULL;
+    return false;
+  }
+  return true;
+}
+
+/* Check a mapped factor before trusting it: every index must be in range,
+*  with the diagonal first in each column and perm a permutation, so that
+*  solve stays within the arrays; and solving against a known x through A must
+*  give x back, which catches a file of another system with a colliding key */
+bool Cholesky::valid(const Stencil &A) const
+{
+  if (Lp[0] != 0 || Lp[n] != (int64_t) nnz) return false;
+  for (int j = 0; j < n; j++) {
+    if (Lp[j + 1] <= Lp[j] || Lp[j + 1] > (int64_t) nnz) return false;
+    if (Li[Lp[j]] != j || !(Lx[Lp[j]] > 0.0)) return false;
+    for (int64_t p = Lp[j] + 1; p < Lp[j + 1]; p++) {
+      if (Li[p] <= j || Li[p] >= n) return false;
+    }
+  }
+  ::std::vector<bool> seen (n, false);
+  for (int k = 0; k < n; k++) {
+    if (perm[k] < 0 || perm[k] >= n || seen[perm[k]]) return false;
+    seen[perm[k]] = true;
+  }
+
+  ::std::vector<double> x (n), b (n);
+  for (int i = 0; i < n; i++) {
+    x[i] = 1.0 + i % 7;
+  }
+  A.apply(&x[0], &b[0]);
+  gsl_vector *xv = gsl_vector_alloc(n);
+  gsl_vector *bv = gsl_vector_alloc(n);
+  for (int i = 0; i < n; i++) {
+    gsl_vector_set(bv, i, b[i]);
+  }
+  bool same = solve(xv, bv, 1) == GSL_SUCCESS;
+  for (int i = 0; same && i < n; i++) {
+    same = fabs(gsl_vector_get(xv, i) - x[i]) <= 1e-6 * 7.0;
+  }
+  gsl_vector_free(xv);
+  gsl_vector_free(bv);
+  return same;
+}
+
+// Stores so far, which tell apart the temporary files of threads of a process
+static ::std::atomic<long> cacheStores (0);
+
+/* Write the factor to path, through a temporary file renamed into place so
+*  that concurrent runs and threads never see a partial one.  Failure only
+*  costs the cache */
+void Cholesky::store(const char *path) const
+{
+  char suffix[48];
+  snprintf(suffix, sizeof(suffix), ".%ld.%ld.tmp", (long) getpid(), cacheStores++);
+  ::std::string tmp = ::std::string(path) + suffix;
+  FILE *file = fopen(tmp.c_str(), "wb");
+  if (file == NULL) {
+    fprintf(stderr, "Warning: cannot write Cholesky cache %s\n", tmp.c_str());
+    return;
+  }
+
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.version = CACHE_VERSION;
+  header.n = n;
+  header.key = key;
+  header.nnz = nnz;
+  size_t offsets[5];
+  cacheLayout(n, nnz, offsets);
+
+  static const char zeros[8] = { 0 };
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1
+    && fwrite(zeros, 1, offsets[0] - sizeof(header), file) == offsets[0] - sizeof(header)
+    && fwrite(Lx, sizeof(double), nnz, file) == nnz
+    && fwrite(Lp, sizeof(int64_t), n + 1, file) == (size_t) n + 1
+    && fwrite(Li, sizeof(int32_t), nnz, file) == nnz
+    && fwrite(zeros, 1, offsets[3] - offsets[2] - nnz * sizeof(int32_t), file)
+       == offsets[3] - offsets[2] - nnz * sizeof(int32_t)
+    && fwrite(perm, sizeof(int32_t), n, file) == (size_t) n;
+  if (fclose(file) != 0 || !written || rename(tmp.c_str(), path) != 0) {
+    fprintf(stderr, "Warning: cannot write Cholesky cache %s\n", path);
+    remove(tmp.c_str());
+  }
+}
+
+int Cholesky::solve(gsl_vector *x, const gsl_vector *b, int nrhs) const
+{
+  if (n == 0) return GSL_SUCCESS;
+  if (!ok()) return GSL_EDOM;
+  int K = nrhs;
+
+  /* y = P b, then L z = y, then L^T w = z, then x = P^T w, all in place */
+  ::std::vector<double> y ((size_t) n * K);
+  for (int k = 0; k < n; k++) {
+    for (int c = 0; c < K; c++) {
+      y[(size_t) k * K + c] = gsl_vector_get(b, (size_t) perm[k] * K + c);
+    }
+  }
+  for (int j = 0; j < n; j++) {
+    double *yj = &y[(size_t) j * K];
+    double inv = 1.0 / Lx[Lp[j]];
+    for (int c = 0; c < K; c++) {
+      yj[c] *= inv;
+    }
+    for (int64_t p = Lp[j] + 1; p < Lp[j + 1]; p++) {
+      double *yi = &y[(size_t) Li[p] * K];
+      for (int c = 0; c < K; c++) {
+        yi[c] -= Lx[p] * yj[c];
+      }
+    }
+  }
+  for (int j = n - 1; j >= 0; j--) {
+    double *yj = &y[(size_t) j * K];
+    for (int64_t p = Lp[j] + 1; p < Lp[j + 1]; p++) {
+      const double *yi = &y[(size_t) Li[p] * K];
+      for (int c = 0; c < K; c++) {
+        yj[c] -= Lx[p] * yi[c];
+      }
+    }
+    double inv = 1.0 / Lx[Lp[j]];
+    for (int c = 0; c < K; c++) {
+      yj[c] *= inv;
+    }
+  }
+  for (int k = 0; k < n; k++) {
+    for (int c = 0; c < K; c++) {
+      gsl_vector_set(x, (size_t) perm[k] * K + c, y[(size_t) k * K + c]);
+    }
+  }
+  return GSL_SUCCESS;
+}
@@ -0,0 +1,74 @@
+#ifndef CHOLESKY_H
+#define CHOLESKY_H
+/*
+cholesky.h
+Direct sparse Cholesky solver for the Poisson system over Omega.  Unknowns are
+ordered by nested dissection of the pixel grid, which keeps the fill of the
+factor L near O(N log N), and each solve is then two triangular sweeps.  The
+factor depends only on the geometry of Omega, so it can be kept in a cache
+directory under a hash of the stencil, and mapped straight from the file by
+later runs that meet the same mask.
+*/
+
+#include <vector>
+#include <stdint.h>
+#include <gsl/gsl_vector.h>
+
+#include "stencil.h"
+
+
+class Cholesky {
+public:
+  // Factor A, or, if cacheDir is set and holds the factor of the same system,
+  // map it from there; a factor computed here is then stored there.  The
+  // factor is only usable if ok()
+  Cholesky(const Stencil &A, const char *cacheDir = NULL);
+  ~Cholesky();
+
+  // False if A is singular (no pixel of Omega borders dest), in which case
+  // nothing was factored
+  bool ok() const
+    { return n == 0 || Lx != NULL; }
+
+  // True if the factor was mapped from the cache
+  bool cached() const
+    { return mapping != NULL; }
+
+  // Solve Ax = b exactly for nrhs interleaved right-hand sides (entry
+  // id * nrhs + k).  Returns a GSL status code
+  int solve(gsl_vector *x, const gsl_vector *b, int nrhs) const;
+
+  // Nonzeros of L, and the bytes held by the factor and the ordering
+  size_t nonzeros() const
+    { return nnz; }
+  size_t memory() const;
+
+private:
+  int n;
+  size_t nnz;
+  uint64_t key;  // hash of the structure of A
+
+  // L in compressed column format, diagonal entry first in each column, and
+  // the elimination order (position k holds Omega ID perm[k]).  These point
+  // either into the vectors below or into the mapped cache file
+  const int64_t *Lp;
+  const int32_t *Li;
+  const double *Lx;
+  const int32_t *perm;
+
+  ::std::vector<int64_t> Lp_;
+  ::std::vector<int32_t> Li_, perm_;
+  ::std::vector<double> Lx_;
+  void *mapping;
+  size_t mappingSize;
+
+  bool factor(const Stencil &A);
+  bool load(const char *path, const Stencil &A);
+  bool valid(const Stencil &A) const;
+  void store(const char *path) const;
+
+  Cholesky(const Cholesky &);
+  Cholesky &operator=(const Cholesky &);
+};
+
+#endif
@@ -0,0 +1,663 @@
+/*
+clone.cpp
+Poisson cloning sessions: assembly of the right-hand side per cloning mode and
+the solve of each component of Omega.
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <algorithm>
+#include <gsl/gsl_errno.h>
+#include <gsl/gsl_spmatrix.h>
+#include <gsl/gsl_splinalg.h>
+
+#include "clone.h"
+#include "multigrid.h"
+#include "spectral.h"
+#include "cholesky.h"
+#include "gradient.h"
+#include "pixels.h"
+#include "timing.h"
+
+/*******************************************************************************
+Helper functions
+*******************************************************************************/
+
+const char *solverName(SolverType solver)
+{
+  switch (solver) {
+    case SOLVER_GMRES: return "gmres";
+    case SOLVER_MG: return "mg";
+    case SOLVER_FMG: return "fmg";
+    case SOLVER_PCG: return "pcg";
+    case SOLVER_FFT: return "fft";
+    case SOLVER_CHOLESKY: return "cholesky";
+    default: return "auto";
+  }
+}
+
+/* Solve a sparse linear system of equations of form Ax = b, appending the
+* relative residual after each restart to history.
+* Code sourced from docs: https://www.gnu.org/software/gsl/doc/html/splinalg.html
+*/
+static int solve(gsl_spmatrix *A, gsl_vector *x, gsl_vector *b, int OMEGA_SIZE, ::std::vector<double> &history)
+{
+  const double tol = 1.0e-6;  /* solution relative tolerance */
+  const size_t max_iter = 1000; /* maximum iterations */
+  const gsl_splinalg_itersolve_type *T = gsl_splinalg_itersolve_gmres;
+  gsl_splinalg_itersolve *work = gsl_splinalg_itersolve_alloc(T, OMEGA_SIZE, 0);
+  size_t iter = 0;
+  double residual;
+  double bnorm = 0.0;
+  int status;
+  for (int i = 0; i < OMEGA_SIZE; i++) {
+    bnorm += gsl_vector_get(b, i) * gsl_vector_get(b, i);
+  }
+  bnorm = sqrt(bnorm);
+
+  /* solve the system Ax = b */
+  do {
+    status = gsl_splinalg_itersolve_iterate(A, b, tol, x, work);
+    residual = gsl_splinalg_itersolve_normr(work);
+    history.push_back(bnorm > 0.0 ? residual / bnorm : residual);
+
+    /* print out residual norm ||A*x - b|| */
+    if (iter % 100 == 0) {
+      fprintf(stderr, "iter %zu residual = %.12e\n", iter, residual);
+    }
+
+    if (status == GSL_SUCCESS)
+    fprintf(stderr, "Converged\n");
+  } while (status == GSL_CONTINUE && ++iter < max_iter);
+
+  gsl_splinalg_itersolve_free(work);
+  return status;
+}
+
+/*******************************************************************************
+Guidance fields
+*******************************************************************************/
+
+/* Each cloning mode is a policy that gives the guidance g(p) - g(q) between
+* p and q in one channel, from f(p) - f(q) in src (gradg) and, if it sets
+* usesDest, in dest (gradf), in [0, 1] units as read from the planes.
+* Parameters are digested in the constructor, and the assembly below is
+* instantiated per policy so that its inner loop has no mode dispatch */
+
+// Poisson cloning (mode 0): the gradient of src
+struct SeamlessGuidance {
+  static const bool usesDest = false;
+
+  double operator()(double gradg, double /*gradf*/) const
+    { return gradg; }
+};
+
+// Differences are whole 0-255 levels up to float rounding, so the comparisons
+// below are made with half a level to spare, which keeps them exact
+
+// Mixed cloning (mode 1): the stronger of the src and dest gradients, src on a tie
+struct MixedGuidance {
+  static const bool usesDest = true;
+
+  double operator()(double gradg, double gradf) const
+    { return (fabs(gradf) > fabs(gradg) + 0.5 / 255.0) ? gradf : gradg; }
+};
+
+// Flattening (mode 2): src gradients above a threshold, scaled by a factor
+struct FlatGuidance {
+  static const bool usesDest = false;
+  double threshold, factor;
+
+  // threshold is in 0-255 levels
+  FlatGuidance(double threshold_, double factor_)
+    : threshold((floor(threshold_) + 0.5) / 255.0), factor(factor_)
+    {}
+
+  double operator()(double gradg, double /*gradf*/) const
+    { return (fabs(gradg) > threshold) ? gradg * factor : 0.0; }
+};
+
+// Local illumination changes (mode 3): src gradients scaled by alpha^beta
+// |grad|^-beta, where the gradient norm is taken to be 1
+struct IlluminationGuidance {
+  static const bool usesDest = false;
+  double scale;
+
+  IlluminationGuidance(double alpha, double beta) : scale(pow(alpha, beta) * pow(fabs(1.0), -1.0 * beta))
+    {}
+
+  // skip zero gradients to avoid NaN
+  double operator()(double gradg, double /*gradf*/) const
+    { return (gradg != 0) ? scale * gradg : 0.0; }
+};
+
+// Texture (mode 4): src gradients, plus dest gradients below a threshold to
+// keep the grain (not perfect -> leads to discoloration and only adds more grain)
+struct TextureGuidance {
+  static const bool usesDest = true;
+  double threshold;
+
+  // threshold is in 0-255 levels
+  explicit TextureGuidance(double threshold_) : threshold((ceil(threshold_) - 0.5) / 255.0)
+    {}
+
+  double operator()(double gradg, double gradf) const
+    { return (fabs(gradf) < threshold) ? gradf + gradg : gradg; }
+};
+
+/* Rows of src and dest differences kept at a time during assembly */
+static const int GRADIENT_BAND = 32;
+
+/* Fill rhs for the Omega pixels of the stencil.  dest covers the frame of the
+* stencil, and frame pixel (x, y) reads pixel (x - xOff, y - yOff) of src.
+* Guidance is 0 where p or q falls outside src */
+template <class Guidance>
+static void assemble(const Guidance &guide, const PlanarIm &src, const PlanarIm &dest,
+                     int xOff, int yOff, const Stencil &stencil, gsl_vector *rhs)
+{
+  /* Offsets to the neighbors, in stencil direction order */
+  static const int dx[4] = { 0, 1, 0, -1 };
+  static const int dy[4] = { -1, 0, 1, 0 };
+
+  int FW = stencil.width();
+  int FH = stencil.height();
+  int srcW = src.w();
+  int srcH = src.h();
+  const ::std::vector<int> &toMask = stencil.pixels();
+  ThreadPool *pool = stencil.threads();
+
+  /* Iterate through the pixels in Omega (each row of the system is independent)... */
+  parallelFor(pool, stencil.size(), 1024, [&](int begin, int end) {
+    // Differences of src (and dest if needed) for the band of rows at hand;
+    // IDs descend with the pixel index, so the rows of the chunk ascend
+    GradientField gs (src, FW, xOff, yOff);
+    GradientField gd (dest, FW);
+    int bandEnd = -1;
+
+    for (int id = end - 1; id >= begin; id--) {
+      // Coords of p in the frame and in src
+      int f = toMask[id];
+      int fy = f / FW;
+      int fx = f - fy * FW;
+      int pu = fx - xOff;
+      int pv = fy - yOff;
+      bool pInSrc = pu >= 0 && pv >= 0 && pu < srcW && pv < srcH;
+      double val[3] = {0.0, 0.0, 0.0}; // RHS of equation
+
+      // North neighbors read the differences of the row above
+      if (fy >= bandEnd) {
+        bandEnd = ::std::min(fy + GRADIENT_BAND, FH);
+        gs.band(::std::max(fy - 1, 0), bandEnd);
+        if (Guidance::usesDest) gd.band(::std::max(fy - 1, 0), bandEnd);
+      }
+
+      // Each neighbor q in the image contributes its guidance and, for q in
+      // the boundary of Omega, its dest value (q in Omega is -fq in the stencil).
+      // f(p) - f(q) is the forward difference at frame pixel q to the north and
+      // west, and minus the one at p to the east and south
+      auto neighbor = [&](int j, int at, bool vertical, double sign) {
+        int status = stencil.status(id, j);
+
+        // Ignore pixels outside the image
+        if (status == STENCIL_OUTSIDE) {
+          return;
+        }
+
+        // Guidance constraints
+        int qu = pu + dx[j];
+        int qv = pv + dy[j];
+        if (pInSrc && qu >= 0 && qv >= 0 && qu < srcW && qv < srcH) {
+          for (int c = 0; c < 3; c++) {
+            double gradg = sign * (vertical ? gs.dy(c, at) : gs.dx(c, at));
+            double gradf = !Guidance::usesDest ? 0.0 : sign * (vertical ? gd.dy(c, at) : gd.dx(c, at));
+            val[c] += guide(gradg, gradf);
+          }
+        }
+
+        // f* boundary constraint
+        if (status == STENCIL_BOUNDARY) {
+          for (int c = 0; c < 3; c++) {
+            val[c] += dest(fx + dx[j], fy + dy[j], c);
+          }
+        }
+      };
+      neighbor(STENCIL_NORTH, f - FW, true, 1.0);
+      neighbor(STENCIL_EAST, f, false, -1.0);
+      neighbor(STENCIL_SOUTH, f, true, -1.0);
+      neighbor(STENCIL_WEST, f - 1, false, 1.0);
+
+      // Record constraints
+      for (int c = 0; c < 3; c++) {
+        gsl_vector_set(rhs, 3*id + c, val[c]);
+      }
+    }
+  });
+}
+
+/*******************************************************************************
+Component systems
+*******************************************************************************/
+
+/* The system of one component of Omega: its index maps and stencil, and each
+*  solver it has used so far, set up on first use and kept for later solves */
+struct ComponentSystem {
+  Component &comp;
+  ThreadPool *pool;  // used by this component only, if set
+  Stencil local;
+  bool rectangle;
+  int box[4];
+
+  Multigrid *mg;
+  PCG *pcg;
+  PCGSingle *single;
+  Spectral *fft;
+  Cholesky *chol;
+  gsl_spmatrix *matrix;
+
+  // comp must have its maps built
+  ComponentSystem(Component &comp_, ThreadPool *pool_)
+    : comp(comp_), pool(pool_),
+      local(comp.toOmega, comp.toMask, comp.width, comp.height, pool),
+      mg(NULL), pcg(NULL), single(NULL), fft(NULL), chol(NULL), matrix(NULL)
+    { rectangle = Spectral::rectangular(local, box); }
+
+  ~ComponentSystem()
+  {
+    delete mg;
+    delete pcg;
+    delete single;
+    delete fft;
+    delete chol;
+    if (matrix) gsl_spmatrix_free(matrix);
+  }
+
+private:
+  ComponentSystem(const ComponentSystem &);
+  ComponentSystem &operator=(const ComponentSystem &);
+};
+
+/* Solve the system of one component of Omega in place, reading and writing
+*  its entries of the interleaved x and rhs of the whole system */
+static void solveComponent(ComponentSystem &sys, gsl_vector *x, const gsl_vector *rhs,
+                           const SolverOptions &opts, ComponentResult &res)
+{
+  double start = wallTime();
+  const Component &comp = sys.comp;
+  int n = comp.size();
+
+  gsl_vector *xl = gsl_vector_alloc(3 * n);
+  gsl_vector *bl = gsl_vector_alloc(3 * n);
+  for (int l = 0; l < n; l++) {
+    for (int c = 0; c < 3; c++) {
+      gsl_vector_set(xl, 3*l + c, gsl_vector_get(x, 3*comp.ids[l] + c));
+      gsl_vector_set(bl, 3*l + c, gsl_vector_get(rhs, 3*comp.ids[l] + c));
+    }
+  }
+
+  /* A rectangular component can be solved directly with fast transforms */
+  res = ComponentResult();
+  res.solver = opts.solver;
+  if (res.solver == SOLVER_AUTO) {
+    res.solver = sys.rectangle ? SOLVER_FFT : SOLVER_GMRES;
+  } else if (res.solver == SOLVER_FFT && !sys.rectangle) {
+    res.solver = SOLVER_GMRES;
+  }
+
+  /* The factor is set up first, since a singular system falls back to PCG */
+  if (res.solver == SOLVER_CHOLESKY && !sys.chol) {
+    double factoring = wallTime();
+    sys.chol = new Cholesky(sys.local, opts.cache.empty() ? NULL : opts.cache.c_str());
+    res.matrix = wallTime() - factoring;
+  }
+  if (res.solver == SOLVER_CHOLESKY && !sys.chol->ok()) {
+    res.solver = SOLVER_PCG;
+  }
+
+  if (res.solver == SOLVER_MG || res.solver == SOLVER_FMG) {
+    if (!sys.mg) sys.mg = new Multigrid(comp.toMask, comp.width, comp.height, 3, sys.pool);
+    res.levels = sys.mg->levels();
+    sys.mg->recordResiduals(res.residuals);
+    res.status = sys.mg->solve(xl, bl, opts.tol, opts.max_cycles, res.solver == SOLVER_FMG, res.iter);
+    sys.mg->recordResiduals(NULL);
+  } else if (res.solver == SOLVER_PCG && opts.precision != PRECISION_DOUBLE) {
+    if (!sys.single) sys.single = new PCGSingle(sys.local, opts.precond, 3);
+    res.memory = sys.single->memory();
+    sys.single->recordResiduals(res.residuals);
+    if (opts.precision == PRECISION_MIXED) {
+      res.status = sys.single->refine(xl, bl, opts.tol, opts.max_iter, res.iter, &res.steps);
+    } else {
+      res.status = sys.single->solve(xl, bl, opts.tol, opts.max_iter, res.iter);
+    }
+    sys.single->recordResiduals(NULL);
+  } else if (res.solver == SOLVER_PCG) {
+    if (!sys.pcg) sys.pcg = new PCG(sys.local, opts.precond, 3);
+    res.memory = sys.pcg->memory();
+    sys.pcg->recordResiduals(res.residuals);
+    res.status = sys.pcg->solve(xl, bl, opts.tol, opts.max_iter, res.iter);
+    sys.pcg->recordResiduals(NULL);
+  } else if (res.solver == SOLVER_CHOLESKY) {
+    res.memory = sys.chol->memory();
+    res.cached = sys.chol->cached();
+    res.status = sys.chol->solve(xl, bl, 3);
+  } else if (res.solver == SOLVER_FFT) {
+    if (!sys.fft) sys.fft = new Spectral(sys.local, sys.box);
+    res.status = sys.fft->solve(xl, bl, 3);
+  } else {
+    /* GSL's GMRES needs the matrix itself and takes one channel at a time */
+    if (!sys.matrix) {
+      double assembly = wallTime();
+      sys.matrix = sys.local.compress();
+      res.matrix = wallTime() - assembly;
+    }
+    gsl_vector *xc = gsl_vector_alloc(n);
+    gsl_vector *bc = gsl_vector_alloc(n);
+    for (int c = 0; c < 3; c++) {
+      for (int l = n - 1; l >= 0; l--) {
+        gsl_vector_set(xc, l, gsl_vector_get(xl, 3*l + c));
+        gsl_vector_set(bc, l, gsl_vector_get(bl, 3*l + c));
+      }
+      int status = solve(sys.matrix, xc, bc, n, res.residuals[c]);
+      res.iter[c] = (int) res.residuals[c].size();
+      if (status != GSL_SUCCESS) res.status = status;
+      for (int l = n - 1; l >= 0; l--) {
+        gsl_vector_set(xl, 3*l + c, gsl_vector_get(xc, l));
+      }
+    }
+    gsl_vector_free(xc);
+    gsl_vector_free(bc);
+  }
+
+  /* Components own disjoint entries, so they can be written back concurrently */
+  for (int l = 0; l < n; l++) {
+    for (int c = 0; c < 3; c++) {
+      gsl_vector_set(x, 3*comp.ids[l] + c, gsl_vector_get(xl, 3*l + c));
+    }
+  }
+  gsl_vector_free(xl);
+  gsl_vector_free(bl);
+  res.seconds = wallTime() - start;
+}
+
+/*******************************************************************************
+Clone sessions
+*******************************************************************************/
+
+/* Frame of Omega within a mask: the tight bounding box of its white pixels,
+*  from the first and last white flag of each row, grown by one pixel for the
+*  boundary and clipped to the image */
+bool maskFrame(const Im &mask, int &left, int &top, int &width, int &height)
+{
+  int W = mask.w();
+  int H = mask.h();
+  ::std::vector<uint64_t> white;
+  int words = (W + 63) / 64;
+  int x0 = W, y0 = H, x1 = -1, y1 = -1;
+  for (int y = 0; y < H; y++) {
+    whiteRow(mask, 0, y, W, white);
+    int first = 0;
+    while (first < words && !white[first]) first++;
+    if (first == words) continue;
+    int last = words - 1;
+    while (!white[last]) last--;
+    x0 = ::std::min(x0, 64 * first + __builtin_ctzll(white[first]));
+    x1 = ::std::max(x1, 64 * last + 63 - __builtin_clzll(white[last]));
+    y0 = ::std::min(y0, y);
+    y1 = y;
+  }
+
+  left = top = width = height = 0;
+  if (x1 < 0) return false;
+  left = ::std::max(x0 - 1, 0);
+  top = ::std::max(y0 - 1, 0);
+  width = ::std::min(x1 + 1, W - 1) - left + 1;
+  height = ::std::min(y1 + 1, H - 1) - top + 1;
+  return true;
+}
+
+CloneSession::CloneSession(const Im &dest, const Im &mask, const SolverOptions &opts_)
+  : opts(opts_), left(0), top(0), FW(0), FH(0), pool(NULL), stencil(NULL), destF(NULL),
+    result(NULL), rhs(NULL), x(NULL), guess(NULL), warm(false)
+{
+  setup(mask);
+
+  /* The solver reads and writes float planes: the frame of dest is converted
+  *  from 8 bits once here, and written back from a copy after each solve */
+  destF = new PlanarIm(dest, left, top, FW, FH);
+  result = new PlanarIm(dest, left, top, FW, FH);
+}
+
+CloneSession::CloneSession(const PlanarIm &dest, const Im &mask, const SolverOptions &opts_)
+  : opts(opts_), left(0), top(0), FW(0), FH(0), pool(NULL), stencil(NULL), destF(NULL),
+    result(NULL), rhs(NULL), x(NULL), guess(NULL), warm(false)
+{
+  setup(mask);
+  destF = new PlanarIm(dest, left, top, FW, FH);
+  result = new PlanarIm(dest, left, top, FW, FH);
+}
+
+/* Everything that depends on the mask alone */
+void CloneSession::setup(const Im &mask)
+{
+  double start = wallTime();
+
+  /* Every index map below covers only the frame.  Neighbors of Omega then lie
+  *  outside the frame exactly when they lie outside the image */
+  maskFrame(mask, left, top, FW, FH);
+  int FN = FW*FH;
+  ::std::vector<uint64_t> white;
+
+  /* Map frame pixel indices to Omega membership, given by ID <id>. An ID of -1
+  *  implies the pixel lies outside a mask (it may still be a boundary pixel though) */
+  toOmega.assign(FN, -1);
+  int id = 0;
+  for (int fy = FH - 1; fy >= 0; fy--) {
+    whiteRow(mask, left, top + fy, FW, white);
+    for (int fx = FW - 1; fx >= 0; fx--) {
+      if (bitSet(white, fx)) {
+        toOmega[fy * FW + fx] = id;
+        id++;
+      }
+    }
+  }
+
+  /* Now reverse the mapping now that we know how many ids we have */
+  int OMEGA_SIZE = id;
+  toMask.resize(OMEGA_SIZE);
+  for (int i = FN - 1; i >= 0; i--) {
+    if (toOmega[i] >= 0) {
+      toMask[toOmega[i]] = i;
+    }
+  }
+
+  /* Worker threads, if asked for */
+  if (opts.threads > 1) {
+    pool = new ThreadPool(opts.threads);
+  }
+  stencil = new Stencil(toOmega, toMask, FW, FH, pool);
+
+  /* Disjoint parts of Omega are independent systems.  One holding most of
+  *  Omega gets all the threads to itself; the others are solved one per thread */
+  labelComponents(*stencil, components);
+  systems.resize(components.size());
+  for (size_t k = 0; k < components.size(); k++) {
+    bool threaded = pool && 2 * components[k].size() > OMEGA_SIZE;
+    components[k].buildMaps(*stencil);
+    systems[k] = new ComponentSystem(components[k], threaded ? pool : NULL);
+  }
+
+  rhs = gsl_vector_alloc(3 * OMEGA_SIZE);    /* vector of "known colors" */
+  x = gsl_vector_alloc(3 * OMEGA_SIZE);      /* vector for solutions (LHS) */
+  guess = gsl_vector_alloc(3 * OMEGA_SIZE);
+  last.indexing = wallTime() - start;
+  last.indexingKB = peakRSS();
+}
+
+CloneSession::~CloneSession()
+{
+  for (size_t k = 0; k < systems.size(); k++) {
+    delete systems[k];
+  }
+  delete stencil;
+  delete pool;
+  delete destF;
+  delete result;
+  gsl_vector_free(rhs);
+  gsl_vector_free(x);
+  gsl_vector_free(guess);
+}
+
+/* Solve every component of Omega into x, largest first */
+void CloneSession::solveAll(gsl_vector *x, const SolverOptions &opts, ::std::vector<ComponentResult> &results)
+{
+  results.resize(components.size());
+  ::std::vector<int> order (components.size());
+  for (size_t k = 0; k < order.size(); k++) {
+    order[k] = (int) k;
+  }
+  ::std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return components[a].size() > components[b].size();
+  });
+  int first = 0;
+  if (!order.empty() && systems[order[0]]->pool) {
+    solveComponent(*systems[order[0]], x, rhs, opts, results[order[0]]);
+    first = 1;
+  }
+  ::std::atomic<int> next (first);
+  int workers = pool ? ::std::min(pool->size(), (int) order.size() - first) : 1;
+  runChunks(pool, workers, [&](int) {
+    for (int k = next++; k < (int) order.size(); k = next++) {
+      solveComponent(*systems[order[k]], x, rhs, opts, results[order[k]]);
+    }
+  });
+}
+
+int CloneSession::clone(const Im &src, int xOff, int yOff, CloneMode mode, double param1, double param2, Im &out)
+{
+  int status = update(src, xOff, yOff, mode, param1, param2);
+  double start = wallTime();
+
+  /* Copy into the frame, and the frame back into 8 bits */
+  for (int id = size() - 1; id >= 0; id--) {
+    for (int c = 0; c < 3; c++) {
+      (*result)(toMask[id] % FW, toMask[id] / FW, c) = (float) gsl_vector_get(x, 3*id + c);
+    }
+  }
+  result->toIm(out, left, top);
+  last.writeback = wallTime() - start;
+  last.writebackKB = peakRSS();
+
+  return status;
+}
+
+int CloneSession::clone(const Im &src, int xOff, int yOff, CloneMode mode, double param1, double param2, PlanarIm &out)
+{
+  int status = update(src, xOff, yOff, mode, param1, param2);
+  double start = wallTime();
+
+  /* Only Omega changes; the values are kept as solved, unclamped */
+  for (int id = size() - 1; id >= 0; id--) {
+    for (int c = 0; c < 3; c++) {
+      out(left + toMask[id] % FW, top + toMask[id] / FW, c) = (float) gsl_vector_get(x, 3*id + c);
+    }
+  }
+  last.writeback = wallTime() - start;
+  last.writebackKB = peakRSS();
+
+  return status;
+}
+
+/* Reassemble the right-hand side for src and solve into x */
+int CloneSession::update(const Im &src, int xOff, int yOff, CloneMode mode, double param1, double param2)
+{
+  int OMEGA_SIZE = size();
+  double start = wallTime();
+
+  /* The part of src the frame maps to, as float planes */
+  int su0 = ::std::max(left - xOff, 0);
+  int sv0 = ::std::max(top - yOff, 0);
+  int su1 = ::std::min(left + FW - xOff, src.w());
+  int sv1 = ::std::min(top + FH - yOff, src.h());
+  PlanarIm srcF (src, su0, sv0, ::std::max(su1 - su0, 0), ::std::max(sv1 - sv0, 0));
+  int sxOff = xOff + su0 - left;  // frame pixel (x, y) is (x - sxOff, y - syOff) in srcF
+  int syOff = yOff + sv0 - top;
+
+  /* One pass over Omega, specialized for the cloning mode */
+  switch (mode) {
+    case CLONE_MIXED:
+      assemble(MixedGuidance(), srcF, *destF, sxOff, syOff, *stencil, rhs);
+      break;
+    case CLONE_FLAT:
+      assemble(FlatGuidance(param1, param2), srcF, *destF, sxOff, syOff, *stencil, rhs);
+      break;
+    case CLONE_ILLUMINATION:
+      assemble(IlluminationGuidance(param1, param2), srcF, *destF, sxOff, syOff, *stencil, rhs);
+      break;
+    case CLONE_TEXTURE:
+      assemble(TextureGuidance(param1), srcF, *destF, sxOff, syOff, *stencil, rhs);
+      break;
+    default:
+      assemble(SeamlessGuidance(), srcF, *destF, sxOff, syOff, *stencil, rhs);
+      break;
+  }
+
+  /* Start from src, or from the previous solution moved by the change in src:
+  *  for seamless cloning the solution is src plus a membrane fixed by the
+  *  boundary, which changes little when src moves a little */
+  last.warm = warm;
+  parallelFor(pool, OMEGA_SIZE, 4096, [&](int begin, int end) {
+    for (int id = end - 1; id >= begin; id--) {
+      int u = toMask[id] % FW - sxOff;
+      int v = toMask[id] / FW - syOff;
+      bool inSrc = u >= 0 && v >= 0 && u < srcF.w() && v < srcF.h();
+      for (int c = 0; c < 3; c++) {
+        double s = inSrc ? srcF(u, v, c) : 0.0;
+        double x0 = warm ? gsl_vector_get(x, 3*id + c) - gsl_vector_get(guess, 3*id + c) + s : s;
+        gsl_vector_set(x, 3*id + c, x0);
+        gsl_vector_set(guess, 3*id + c, s);
+      }
+    }
+  });
+  last.assembly = wallTime() - start;
+  last.assemblyKB = peakRSS();
+
+  /* Keep the starting guess if the solve is to be repeated in double precision */
+  gsl_vector *reference = NULL;
+  if (opts.compare && opts.precision != PRECISION_DOUBLE) {
+    reference = gsl_vector_alloc(3 * OMEGA_SIZE);
+    gsl_vector_memcpy(reference, x);
+  }
+
+  start = wallTime();
+  solveAll(x, opts, last.components);
+  last.solve = wallTime() - start;
+  last.solveKB = peakRSS();
+  int status = GSL_SUCCESS;
+  for (size_t k = 0; k < last.components.size(); k++) {
+    if (last.components[k].status != GSL_SUCCESS) status = last.components[k].status;
+  }
+
+  /* Solve again in double precision and compare the pixels each would write */
+  last.compared = reference != NULL;
+  if (reference) {
+    SolverOptions exact = opts;
+    exact.precision = PRECISION_DOUBLE;
+    ::std::vector<ComponentResult> unused;
+    start = wallTime();
+    solveAll(reference, exact, unused);
+    last.compareSeconds = wallTime() - start;
+    last.maxDiff = 0;
+    last.differing = 0;
+    for (int i = 0; i < 3 * OMEGA_SIZE; i++) {
+      int a = floatToByte((float) gsl_vector_get(x, i));
+      int b = floatToByte((float) gsl_vector_get(reference, i));
+      last.maxDiff = ::std::max(last.maxDiff, abs(a - b));
+      if (a != b) last.differing++;
+    }
+    gsl_vector_free(reference);
+  }
+  warm = true;
+
+  return status;
+}
@@ -0,0 +1,189 @@
+#ifndef CLONE_H
+#define CLONE_H
+/*
+clone.h
+Poisson cloning of src into a fixed dest over the white pixels of a fixed mask.
+A session keeps everything that depends only on the two: the frame and index
+maps of Omega, its stencil, its components and the solver set up for each of
+them, and dest as float planes.  Cloning src at another offset, or another
+src altogether, then only reassembles the right-hand side and solves again
+starting from the previous solution, as an interactive drag of src needs.
+*/
+
+#include <string>
+#include <vector>
+#include <gsl/gsl_vector.h>
+
+#include "./lib/imageio++.h"
+#include "threadpool.h"
+#include "stencil.h"
+#include "pcg.h"
+#include "components.h"
+#include "planar.h"
+
+
+/* Linear solvers selectable with --solver */
+enum SolverType {
+  SOLVER_AUTO,      // spectral for a rectangular Omega, else GMRES (default)
+  SOLVER_GMRES,     // GSL's restarted GMRES on the assembled matrix
+  SOLVER_MG,        // geometric multigrid V-cycles from the source guess
+  SOLVER_FMG,       // full multigrid start followed by V-cycles
+  SOLVER_PCG,       // preconditioned conjugate gradients on the stencil
+  SOLVER_FFT,       // direct sine/cosine transform solve, rectangular Omega only
+  SOLVER_CHOLESKY   // direct sparse Cholesky solve, factor optionally cached on disk
+};
+
+/* Name of a solver as given to --solver */
+const char *solverName(SolverType solver);
+
+/* Options that control how the Poisson system is solved */
+struct SolverOptions {
+  SolverType solver;
+  PrecondType precond;  // preconditioner for SOLVER_PCG
+  PrecisionType precision;  // arithmetic of SOLVER_PCG
+  bool compare;         // also solve in double precision and report the difference
+  double tol;           // relative residual tolerance
+  int max_cycles;       // V-cycle limit for the multigrid solvers
+  int max_iter;         // iteration limit for PCG
+  int threads;          // worker threads for assembly and the mg/pcg solvers
+  ::std::string cache;  // directory of cached Cholesky factors, none if empty
+
+  SolverOptions() : solver(SOLVER_AUTO), precond(PRECOND_IC0), precision(PRECISION_DOUBLE),
+                    compare(false), tol(1.0e-6), max_cycles(100), max_iter(10000), threads(1)
+    {}
+};
+
+/* Guidance fields, with the parameters they take from the command line */
+enum CloneMode {
+  CLONE_SEAMLESS = 0,      // gradient of src
+  CLONE_MIXED = 1,         // stronger of the src and dest gradients
+  CLONE_FLAT = 2,          // src gradients above threshold (param1), times factor (param2)
+  CLONE_ILLUMINATION = 3,  // src gradients scaled by alpha (param1) and beta (param2)
+  CLONE_TEXTURE = 4        // src gradients plus dest ones below threshold (param1)
+};
+
+/* What solving one component took, reported once all of them are done */
+struct ComponentResult {
+  SolverType solver;  // solver used, after resolving auto and fallbacks
+  int status;         // GSL status code, GSL_SUCCESS once every channel converged
+  int iter[3];        // iterations per channel (mg/pcg), or restarts (gmres)
+  int levels;         // multigrid levels
+  int steps;          // refinement steps (mixed precision pcg)
+  size_t memory;      // bytes of the PCG preconditioner and work vectors, or of the Cholesky factor
+  bool cached;        // Cholesky factor mapped from the cache
+  double matrix;      // seconds spent assembling the matrix (gmres) or factoring it (cholesky)
+  double seconds;     // seconds in total, including the above
+
+  // Relative residual ||Ax - b|| / ||b|| per channel, at the start and after
+  // each iteration until the channel converged (gmres: each restart; mixed
+  // precision pcg: each refinement step).  Empty for the direct solvers
+  ::std::vector<double> residuals[3];
+
+  ComponentResult() : solver(SOLVER_AUTO), status(0), levels(0), steps(0), memory(0), cached(false), matrix(0.0), seconds(0.0)
+    { iter[0] = iter[1] = iter[2] = 0; }
+};
+
+/* What the last CloneSession::clone took */
+struct CloneReport {
+  double indexing;   // seconds mapping Omega and setting up its system, when the session was made
+  double assembly;   // seconds converting src and assembling the right-hand side
+  double solve;      // seconds solving every component
+  double writeback;  // seconds copying the solution into the output
+  long indexingKB, assemblyKB, solveKB, writebackKB;  // peak memory of the process once each of the above ended
+  bool warm;         // started from the previous solution rather than from src
+  ::std::vector<ComponentResult> components;  // in label order
+
+  // With SolverOptions::compare and reduced precision: the time of the double
+  // precision solve and how far the pixels it gives are from those written
+  bool compared;
+  double compareSeconds;
+  int maxDiff, differing;
+
+  CloneReport() : indexing(0.0), assembly(0.0), solve(0.0), writeback(0.0),
+                  indexingKB(0), assemblyKB(0), solveKB(0), writebackKB(0), warm(false), compared(false), compareSeconds(0.0),
+                  maxDiff(0), differing(0)
+    {}
+};
+
+/* Frame of Omega, the white pixels of mask: their bounding box grown by one
+*  pixel for the boundary and clipped to the image.  False, and an empty frame,
+*  if the mask has no white pixel */
+bool maskFrame(const Im &mask, int &left, int &top, int &width, int &height);
+
+struct ComponentSystem;
+
+class CloneSession {
+public:
+  // Map Omega, the white pixels of mask, within dest, which must have the same
+  // size, and set up its system.  Solvers are set up for each component the
+  // first time it is solved, and kept
+  CloneSession(const Im &dest, const Im &mask, const SolverOptions &opts);
+  CloneSession(const PlanarIm &dest, const Im &mask, const SolverOptions &opts);
+  ~CloneSession();
+
+  // Clone src with its top left corner at (xOff, yOff) of dest, in the given
+  // mode, and write the frame of the result into out, which must be the size
+  // of dest and is left alone outside the frame.  The first call starts from
+  // the src pixels; later ones from the previous solution, moved by the change
+  // in the src pixels under Omega.  Returns a GSL status code
+  int clone(const Im &src, int xOff, int yOff, CloneMode mode, double param1, double param2, Im &out);
+
+  // As above, but write only the pixels of Omega into out, as float planes
+  // the size of dest, without rounding them to 8 bits
+  int clone(const Im &src, int xOff, int yOff, CloneMode mode, double param1, double param2, PlanarIm &out);
+
+  // Forget the previous solution, so that the next clone starts from src
+  void reset()
+    { warm = false; }
+
+  // Number of unknowns, and the frame of Omega in dest
+  int size() const
+    { return (int) toMask.size(); }
+  int frameLeft() const
+    { return left; }
+  int frameTop() const
+    { return top; }
+  int frameWidth() const
+    { return FW; }
+  int frameHeight() const
+    { return FH; }
+
+  // Connected components of Omega, with frame relative positions
+  const ::std::vector<Component> &parts() const
+    { return components; }
+
+  // Worker threads, if the options asked for more than one
+  const ThreadPool *threads() const
+    { return pool; }
+
+  // What the last call to clone took
+  const CloneReport &report() const
+    { return last; }
+
+private:
+  SolverOptions opts;
+  int left, top, FW, FH;
+  ::std::vector<int> toOmega, toMask;
+  ThreadPool *pool;
+  Stencil *stencil;
+  ::std::vector<Component> components;
+  ::std::vector<ComponentSystem *> systems;
+  PlanarIm *destF;   // frame of dest, as read
+  PlanarIm *result;  // frame of dest with Omega as last solved
+
+  // RGB values are interleaved, so that entry 3*id + c holds channel c of the
+  // Omega pixel with ID <id> and each pass over the stencil serves all three
+  gsl_vector *rhs, *x;
+  gsl_vector *guess;  // src under Omega as of the last solve, for warm starts
+  bool warm;
+  CloneReport last;
+
+  void setup(const Im &mask);
+  int update(const Im &src, int xOff, int yOff, CloneMode mode, double param1, double param2);
+  void solveAll(gsl_vector *x, const SolverOptions &opts, ::std::vector<ComponentResult> &results);
+
+  CloneSession(const CloneSession &);
+  CloneSession &operator=(const CloneSession &);
+};
+
+#endif
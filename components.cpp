@@ -0,0 +1,80 @@
+/*
+components.cpp
+Connected components of Omega.
+*/
+
+#include <algorithm>
+
+#include "components.h"
+
+void labelComponents(const Stencil &A, ::std::vector<Component> &components)
+{
+  int OMEGA_SIZE = A.size();
+  int W = A.width();
+  int H = A.height();
+  const ::std::vector<int> &toMask = A.pixels();
+  ::std::vector<char> seen (OMEGA_SIZE, 0);
+  ::std::vector<int> stack;
+
+  components.clear();
+  for (int seed = 0; seed < OMEGA_SIZE; seed++) {
+    if (seen[seed]) continue;
+
+    /* Flood fill through the neighbors in Omega */
+    components.push_back(Component());
+    Component &comp = components.back();
+    seen[seed] = 1;
+    stack.push_back(seed);
+    while (!stack.empty()) {
+      int id = stack.back();
+      stack.pop_back();
+      comp.ids.push_back(id);
+      for (int dir = 0; dir < 4; dir++) {
+        if (A.status(id, dir) != STENCIL_OMEGA) continue;
+        int q = A.neighbor(id, dir);
+        if (!seen[q]) {
+          seen[q] = 1;
+          stack.push_back(q);
+        }
+      }
+    }
+    ::std::sort(comp.ids.begin(), comp.ids.end());
+
+    /* Bounding box grown by one pixel for the boundary */
+    int x0 = W, y0 = H, x1 = -1, y1 = -1;
+    for (size_t l = 0; l < comp.ids.size(); l++) {
+      int px = toMask[comp.ids[l]] % W;
+      int py = toMask[comp.ids[l]] / W;
+      x0 = ::std::min(x0, px);
+      x1 = ::std::max(x1, px);
+      y0 = ::std::min(y0, py);
+      y1 = ::std::max(y1, py);
+    }
+    comp.left = ::std::max(x0 - 1, 0);
+    comp.top = ::std::max(y0 - 1, 0);
+    comp.width = ::std::min(x1 + 1, W - 1) - comp.left + 1;
+    comp.height = ::std::min(y1 + 1, H - 1) - comp.top + 1;
+  }
+}
+
+void Component::buildMaps(const Stencil &A)
+{
+  int W = A.width();
+  const ::std::vector<int> &pixels = A.pixels();
+
+  /* Ascending IDs are descending pixels, as in the whole system */
+  toOmega.assign(width * height, -1);
+  toMask.resize(ids.size());
+  for (size_t l = 0; l < ids.size(); l++) {
+    int p = pixels[ids[l]];
+    int local = (p / W - top) * width + (p % W - left);
+    toMask[l] = local;
+    toOmega[local] = (int) l;
+  }
+}
+
+void Component::freeMaps()
+{
+  ::std::vector<int>().swap(toOmega);
+  ::std::vector<int>().swap(toMask);
+}
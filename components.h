@@ -0,0 +1,42 @@
+#ifndef COMPONENTS_H
+#define COMPONENTS_H
+/*
+components.h
+Connected components of Omega.  Pixels in different 4-connected components
+never share an equation, so each component is an independent Poisson system
+that can be solved on its own, and alongside the others.
+*/
+
+#include <vector>
+
+#include "stencil.h"
+
+
+// One 4-connected component of Omega, with the index maps of its own system
+class Component {
+public:
+  // Omega IDs of the component in the whole system, ascending; local ID l of
+  // the component is ids[l]
+  ::std::vector<int> ids;
+
+  // Frame of the local system: the bounding box grown by one pixel and clipped
+  // to the image, so that every neighbor in the image is inside the frame
+  int left, top, width, height;
+
+  // Frame pixel -> local ID (-1 outside the component) and back; filled by
+  // buildMaps for as long as the system of the component is kept
+  ::std::vector<int> toOmega, toMask;
+
+  // Number of unknowns
+  int size() const
+    { return (int) ids.size(); }
+
+  // Fill toOmega and toMask, or release them
+  void buildMaps(const Stencil &A);
+  void freeMaps();
+};
+
+/* Split Omega into its 4-connected components, in order of their smallest ID */
+void labelComponents(const Stencil &A, ::std::vector<Component> &components);
+
+#endif
@@ -0,0 +1,66 @@
+/*
+gradient.cpp
+Forward differences of an image over the frame of Omega.
+*/
+
+#include <algorithm>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include "gradient.h"
+
+void floatDifference(const float *a, const float *b, float *out, int n)
+{
+  int i = 0;
+#if defined(__AVX__)
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(out + i, _mm256_sub_ps(_mm256_loadu_ps(b + i), _mm256_loadu_ps(a + i)));
+  }
+#elif defined(__SSE__)
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(out + i, _mm_sub_ps(_mm_loadu_ps(b + i), _mm_loadu_ps(a + i)));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = b[i] - a[i];
+  }
+}
+
+GradientField::GradientField(const PlanarIm &im_, int width_, int xOff_, int yOff_)
+  : im(im_), width(width_), xOff(xOff_), yOff(yOff_), first(0), size(0)
+{}
+
+void GradientField::band(int y0, int y1)
+{
+  int W = im.w();
+  int H = im.h();
+  first = y0 * width;
+  size = width * (y1 - y0);
+  gx.assign(3 * (size_t) size, 0.0f);
+  gy.assign(3 * (size_t) size, 0.0f);
+
+  /* Columns of the frame whose pixel of im exists, as im coordinates */
+  int u0 = ::std::max(-xOff, 0);
+  int u1 = ::std::min(width - 1 - xOff, W - 1);
+  if (u0 > u1) return;
+
+  for (int c = 0; c < 3; c++) {
+    for (int y = y0; y < y1; y++) {
+      int v = y - yOff;
+      if (v < 0 || v >= H) continue;
+
+      /* Each difference is one contiguous stream of the plane */
+      const float *row = im.row(c, v) + u0;
+      size_t f = (size_t) c * size + (y - y0) * width + u0 + xOff;
+      if (u1 > u0) {
+        floatDifference(row, row + 1, &gx[f], u1 - u0);
+      }
+      if (v + 1 < H) {
+        floatDifference(row, im.row(c, v + 1) + u0, &gy[f], u1 - u0 + 1);
+      }
+    }
+  }
+}
@@ -0,0 +1,46 @@
+#ifndef GRADIENT_H
+#define GRADIENT_H
+/*
+gradient.h
+Forward differences of an image over the frame of Omega, computed once per
+edge of the pixel grid so that the guidance along an edge is a lookup rather
+than two pixel reads at each of its ends.  Differences are taken plane by
+plane from a PlanarIm and stored the same way, one plane per channel, and are
+kept for a band of rows at a time, so that they stay in cache while the
+equations of the band are assembled.
+*/
+
+#include <vector>
+
+#include "planar.h"
+
+
+class GradientField {
+public:
+  // Differences over a frame of the given width, whose pixel (x, y) reads
+  // pixel (x - xOff, y - yOff) of im.  Differences that need a pixel outside
+  // im are 0
+  GradientField(const PlanarIm &im, int width, int xOff = 0, int yOff = 0);
+
+  // Compute the differences of frame rows [y0, y1)
+  void band(int y0, int y1);
+
+  // I(x + 1, y) - I(x, y) and I(x, y + 1) - I(x, y) in channel c at frame
+  // pixel f, which must lie in the current band
+  float dx(int c, int f) const
+    { return gx[c * size + f - first]; }
+  float dy(int c, int f) const
+    { return gy[c * size + f - first]; }
+
+private:
+  const PlanarIm &im;
+  int width, xOff, yOff;
+  int first;  // frame pixel at the start of the band
+  int size;   // frame pixels in the band, the length of each plane
+  ::std::vector<float> gx, gy;
+};
+
+/* out[i] = b[i] - a[i] for n floats, with SSE or AVX where the build allows */
+void floatDifference(const float *a, const float *b, float *out, int n);
+
+#endif
@@ -0,0 +1,204 @@
+/*
+imagecache.cpp
+Decoded images shared between the jobs of a batch, keyed by path.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+
+#include "imagecache.h"
+
+// Shared file layout: the header, then the RGB pixels row by row
+static const char SHARED_MAGIC[8] = { 'P', 'O', 'I', 'S', 'I', 'M', 'G', '1' };
+
+struct SharedHeader {
+  char magic[8];
+  uint64_t key;
+  int32_t width, height;
+};
+
+// Shared files written so far, which tell apart the temporary files of threads
+// of a process
+static ::std::atomic<long> sharedWrites (0);
+
+ImageCache::ImageCache(size_t budget_, const ::std::string &sharedDir)
+  : budget(budget_), used(0), shared(sharedDir), nlookups(0), nhits(0), nshared(0), nclaims(0)
+{}
+
+::std::shared_ptr<const Im> ImageCache::get(const ::std::string &path)
+{
+  ::std::promise< ::std::shared_ptr<const Im> > promise;
+  Pending known;
+  long serial = 0;
+  {
+    ::std::lock_guard< ::std::mutex> guard(lock);
+    nlookups++;
+    auto found = entries.find(path);
+    if (found != entries.end()) {
+      nhits++;
+      order.splice(order.begin(), order, found->second.use);
+      known = found->second.image;
+    } else {
+      /* Claim the path, so that other jobs wait for this decode */
+      order.push_front(path);
+      Entry &entry = entries[path];
+      entry.image = promise.get_future().share();
+      entry.bytes = 0;
+      entry.use = order.begin();
+      entry.serial = serial = ++nclaims;
+    }
+  }
+  if (known.valid()) {
+    return known.get();
+  }
+
+  /* Decode without holding the lock */
+  ::std::shared_ptr<Im> im (new Im);
+  bool ok = load(path, *im);
+  promise.set_value(ok ? ::std::shared_ptr<const Im>(im) : ::std::shared_ptr<const Im>());
+
+  ::std::lock_guard< ::std::mutex> guard(lock);
+  auto found = entries.find(path);
+  bool claimed = found != entries.end() && found->second.serial == serial;
+  if (!ok) {
+    if (claimed) {
+      order.erase(found->second.use);
+      entries.erase(found);
+    }
+    return ::std::shared_ptr<const Im>();
+  }
+  if (!claimed) return im;
+  found->second.bytes = (size_t) im->w() * im->h() * sizeof(Color);
+  used += found->second.bytes;
+  evict(path);
+  return im;
+}
+
+void ImageCache::forget(const ::std::string &path)
+{
+  ::std::lock_guard< ::std::mutex> guard(lock);
+  auto found = entries.find(path);
+  if (found == entries.end()) return;
+  used -= found->second.bytes;
+  order.erase(found->second.use);
+  entries.erase(found);
+}
+
+/* Drop decoded images, least recently used first, until the budget is met or
+*  only keep is left.  Images still being decoded are not counted yet */
+void ImageCache::evict(const ::std::string &keep)
+{
+  auto it = order.end();
+  while (used > budget && it != order.begin()) {
+    --it;
+    if (*it == keep) continue;
+    auto found = entries.find(*it);
+    if (found->second.bytes == 0) continue;
+    used -= found->second.bytes;
+    entries.erase(found);
+    it = order.erase(it);
+  }
+}
+
+/* Decode the image at path into im, or copy it from the shared directory.  A
+*  fresh decode is stored there through a temporary file renamed into place,
+*  so that concurrent runs and threads never see a partial one */
+bool ImageCache::load(const ::std::string &path, Im &im)
+{
+  struct stat st;
+  if (shared.empty() || stat(path.c_str(), &st) != 0) {
+    return im.read(path);
+  }
+
+  /* FNV-1a hash of the path, size and modification time, to the nanosecond
+  *  so that a file rewritten within the second is told apart */
+  uint64_t key = 14695981039346656037ULL;
+  auto mix = [&](const void *data, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      key ^= ((const unsigned char *) data)[i];
+      key *= 1099511628211ULL;
+    }
+  };
+  int64_t stamp[4] = { (int64_t) st.st_size, (int64_t) st.st_mtime, (int64_t) st.st_mtim.tv_nsec,
+                       (int64_t) st.st_ino };
+  mix(path.data(), path.size());
+  mix(stamp, sizeof(stamp));
+  char name[40];
+  snprintf(name, sizeof(name), "/img-%016llx.rgb", (unsigned long long) key);
+  ::std::string file = shared + name;
+
+  /* Copy the pixels straight from a mapping of the shared file */
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    struct stat fs;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &fs) == 0 && (size_t) fs.st_size >= sizeof(SharedHeader)) {
+      data = mmap(NULL, fs.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data != MAP_FAILED) {
+      const SharedHeader *header = (const SharedHeader *) data;
+      size_t bytes = (size_t) header->width * header->height * sizeof(Color);
+      bool valid = memcmp(header->magic, SHARED_MAGIC, sizeof(SHARED_MAGIC)) == 0 && header->key == key
+        && header->width >= 0 && header->height >= 0 && sizeof(SharedHeader) + bytes == (size_t) fs.st_size;
+      if (valid) {
+        im = Im(header->width, header->height);
+        if (bytes) memcpy(&im[0], (const char *) data + sizeof(SharedHeader), bytes);
+      }
+      munmap(data, fs.st_size);
+      if (valid) {
+        ::std::lock_guard< ::std::mutex> guard(lock);
+        nshared++;
+        return true;
+      }
+    }
+  }
+
+  if (!im.read(path)) return false;
+  char suffix[48];
+  snprintf(suffix, sizeof(suffix), ".%ld.%ld.tmp", (long) getpid(), sharedWrites++);
+  ::std::string tmp = file + suffix;
+  FILE *out = fopen(tmp.c_str(), "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Warning: cannot write shared image %s\n", tmp.c_str());
+    return true;
+  }
+  SharedHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SHARED_MAGIC, sizeof(SHARED_MAGIC));
+  header.key = key;
+  header.width = im.w();
+  header.height = im.h();
+  size_t count = (size_t) im.w() * im.h();
+  bool written = fwrite(&header, sizeof(header), 1, out) == 1
+    && (count == 0 || fwrite(&im[0], sizeof(Color), count, out) == count);
+  if (fclose(out) != 0 || !written || rename(tmp.c_str(), file.c_str()) != 0) {
+    fprintf(stderr, "Warning: cannot write shared image %s\n", file.c_str());
+    remove(tmp.c_str());
+  }
+  return true;
+}
+
+int ImageCache::lookups() const
+{
+  ::std::lock_guard< ::std::mutex> guard(lock);
+  return nlookups;
+}
+
+int ImageCache::hits() const
+{
+  ::std::lock_guard< ::std::mutex> guard(lock);
+  return nhits;
+}
+
+int ImageCache::sharedHits() const
+{
+  ::std::lock_guard< ::std::mutex> guard(lock);
+  return nshared;
+}
@@ -0,0 +1,71 @@
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+/*
+imagecache.h
+Decoded images shared between the jobs of a batch, keyed by path.  The least
+recently used images are dropped once their total size passes a budget, but
+an image stays alive for as long as a job still holds it.  A path asked for
+by several jobs at once is decoded only once; the others wait for it.  With a
+shared directory, decoded pixels are also kept there as files, keyed by the
+path, size and modification time of the image, so that other processes read
+them back with a copy rather than decoding again.
+*/
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <memory>
+#include <future>
+#include <unordered_map>
+
+#include "./lib/imageio++.h"
+
+
+class ImageCache {
+public:
+  // Keep up to budget bytes of decoded pixels, and share them through the
+  // directory sharedDir if it is not empty
+  explicit ImageCache(size_t budget, const ::std::string &sharedDir = "");
+
+  // The image at path, decoded now or earlier; NULL if it cannot be read.
+  // Failures are not cached
+  ::std::shared_ptr<const Im> get(const ::std::string &path);
+
+  // Drop the image at path, which has been written since it was decoded.  A
+  // decode of it still under way is not cached
+  void forget(const ::std::string &path);
+
+  // Lookups so far, and how many of them found the image already decoded or
+  // being decoded
+  int lookups() const;
+  int hits() const;
+
+  // Images copied from the shared directory rather than decoded
+  int sharedHits() const;
+
+private:
+  typedef ::std::shared_future< ::std::shared_ptr<const Im> > Pending;
+
+  struct Entry {
+    Pending image;
+    size_t bytes;  // 0 until decoded
+    long serial;   // which get() claimed the path
+    ::std::list< ::std::string>::iterator use;
+  };
+
+  size_t budget, used;
+  ::std::string shared;
+  int nlookups, nhits, nshared;
+  long nclaims;
+  ::std::list< ::std::string> order;  // most recently used first
+  ::std::unordered_map< ::std::string, Entry> entries;
+  mutable ::std::mutex lock;
+
+  void evict(const ::std::string &keep);
+  bool load(const ::std::string &path, Im &im);
+
+  ImageCache(const ImageCache &);
+  ImageCache &operator=(const ImageCache &);
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef JOBQUEUE_H
+#define JOBQUEUE_H
+/*
+jobqueue.h
+Bounded queue between the stages of a pipeline.  A stage that runs ahead
+blocks once the queue holds capacity items, so that decoded images do not
+pile up in memory faster than they can be cloned and written.
+*/
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+
+template <class T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity_) : capacity(capacity_ > 0 ? capacity_ : 1), closed(false)
+    {}
+
+  // Wait for room, then add item
+  void push(const T &item)
+  {
+    ::std::unique_lock< ::std::mutex> guard(lock);
+    notFull.wait(guard, [&]() { return items.size() < capacity; });
+    items.push_back(item);
+    notEmpty.notify_one();
+  }
+
+  // Wait for an item and take it.  Returns false once the queue is closed and
+  // empty
+  bool pop(T &item)
+  {
+    ::std::unique_lock< ::std::mutex> guard(lock);
+    notEmpty.wait(guard, [&]() { return !items.empty() || closed; });
+    if (items.empty()) return false;
+    item = items.front();
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  // No more items will be pushed; wakes every stage waiting to pop
+  void close()
+  {
+    ::std::lock_guard< ::std::mutex> guard(lock);
+    closed = true;
+    notEmpty.notify_all();
+  }
+
+private:
+  size_t capacity;
+  bool closed;
+  ::std::deque<T> items;
+  ::std::mutex lock;
+  ::std::condition_variable notFull, notEmpty;
+
+  BoundedQueue(const BoundedQueue &);
+  BoundedQueue &operator=(const BoundedQueue &);
+};
+
+#endif
@@ -10,20 +10,80 @@ Simple wrapper for JPEG and PNG libraries for image input and output.
 #include <cstring>
 #include <jpeglib.h>
 #include <png.h>
+#include <csetjmp>
 #include "imageio++.h"
 
 #ifdef WIN32
 # ifndef strcasecmp
 #  define strcasecmp stricmp
 # endif
+#else
+# include <sys/mman.h>
+# include <sys/stat.h>
 #endif
 
 
-// Read an Im from a file.  Returns true if succeeded, else false.
-bool Im::read(const ::std::string &filename)
+// State of a file being read: one of the two decoders, fed from the file
+// mapped into memory where possible, else through stdio
+struct ImReaderState {
+	FILE *f;
+	const unsigned char *map;
+	size_t mapSize, offset;
+	bool jpeg;
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	jmp_buf jpeg_jmp;
+	png_structp png_ptr;
+	png_infop info_ptr, end_ptr;
+};
+
+
+// Report a JPEG decoding error and return to the call that hit it, rather
+// than exit
+static void jpeg_read_error(j_common_ptr cinfo)
+{
+	(*cinfo->err->output_message)(cinfo);
+	ImReaderState *state = (ImReaderState *) cinfo->client_data;
+	longjmp(state->jpeg_jmp, 1);
+}
+
+
+// Feed libpng from the mapped file
+static void png_read_mapped(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+	ImReaderState *state = (ImReaderState *) png_get_io_ptr(png_ptr);
+	if (state->mapSize - state->offset < length)
+		png_error(png_ptr, "Read past end of file");
+	memcpy(data, state->map + state->offset, length);
+	state->offset += length;
+}
+
+
+// Map a regular file read-only.  Returns NULL if it cannot be mapped.
+static const unsigned char *map_file(FILE *f, size_t &size)
+{
+#ifndef WIN32
+	struct stat st;
+	if (fstat(fileno(f), &st) || !S_ISREG(st.st_mode) || st.st_size < 2)
+		return 0;
+	void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if (map == MAP_FAILED)
+		return 0;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	size = st.st_size;
+	return (const unsigned char *) map;
+#else
+	return 0;
+#endif
+}
+
+
+// Open a file and read its header.  Returns true if succeeded, else false.
+bool ImReader::open(const ::std::string &filename)
 {
 	using namespace std;
 
+	close();
 	FILE *f = !strcmp(filename.c_str(), "-") ? stdin :
 		fopen(filename.c_str(), "rb");
 	if (!f) {
@@ -32,57 +92,159 @@ bool Im::read(const ::std::string &filename)
 	}
 
 	/* Peek at the first two characters of the file */
-	int c1 = fgetc(f);
-	int c2 = fgetc(f);
-	ungetc(c2, f);
-	ungetc(c1, f);
+	size_t mapSize = 0;
+	const unsigned char *map = (f == stdin) ? 0 : map_file(f, mapSize);
+	int c1, c2;
+	if (map) {
+		c1 = map[0];
+		c2 = map[1];
+	} else {
+		c1 = fgetc(f);
+		c2 = fgetc(f);
+		ungetc(c2, f);
+		ungetc(c1, f);
+	}
+
+	if ((c1 == 0xff && c2 == 0xd8) || (c1 == 0x89 && c2 == 'P')) {
+		state = new ImReaderState;
+		state->f = f;
+		state->map = map;
+		state->mapSize = mapSize;
+		state->offset = 0;
+	}
 
 	if (c1 == 0xff && c2 == 0xd8) {
 		/* JPEG file */
-		struct jpeg_decompress_struct cinfo;
-		struct jpeg_error_mgr jerr;
-		cinfo.err = jpeg_std_error(&jerr);
-		jpeg_create_decompress(&cinfo);
-		jpeg_stdio_src(&cinfo, f);
-		jpeg_read_header(&cinfo, TRUE);
-		cinfo.out_color_space = JCS_RGB;
-		jpeg_start_decompress(&cinfo);
-		width = cinfo.output_width;
-		height = cinfo.output_height;
-		pixels.resize(w() * h());
-		for (int i = 0; i < h(); i++) {
-			JSAMPROW rowptr = (JSAMPROW) &pixels[i * w()];
-			jpeg_read_scanlines(&cinfo, &rowptr, 1);
+		state->jpeg = true;
+		state->cinfo.err = jpeg_std_error(&state->jerr);
+		state->jerr.error_exit = jpeg_read_error;
+		jpeg_create_decompress(&state->cinfo);
+		state->cinfo.client_data = state;
+		if (setjmp(state->jpeg_jmp)) {
+			abandon();
+			return false;
 		}
-		jpeg_finish_decompress(&cinfo);
-		jpeg_destroy_decompress(&cinfo);
+		if (map)
+			jpeg_mem_src(&state->cinfo, (unsigned char *) map, mapSize);
+		else
+			jpeg_stdio_src(&state->cinfo, f);
+		jpeg_read_header(&state->cinfo, TRUE);
+		state->cinfo.out_color_space = JCS_RGB;
+		jpeg_start_decompress(&state->cinfo);
+		width = state->cinfo.output_width;
+		height = state->cinfo.output_height;
 	} else if (c1 == 0x89 && c2 == 'P') {
 		/* PNG file */
-		png_structp png_ptr =
+		state->jpeg = false;
+		state->png_ptr =
 			png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
-		png_infop info_ptr = png_create_info_struct(png_ptr);
-		png_infop end_ptr = png_create_info_struct(png_ptr);
-		png_init_io(png_ptr, f);
-		png_read_info(png_ptr, info_ptr);
-		png_set_expand(png_ptr);
-		png_set_strip_alpha(png_ptr);
-		png_set_strip_16(png_ptr);
-		png_set_gray_to_rgb(png_ptr);
-		width = png_get_image_width(png_ptr, info_ptr);
-		height = png_get_image_height(png_ptr, info_ptr);
-		pixels.resize(w() * h());
-		for (int i = 0; i < h(); i++) {
-			png_bytep row_pointer = (png_bytep) &pixels[i * w()];
-			png_read_row(png_ptr, row_pointer, NULL);
+		state->info_ptr = png_create_info_struct(state->png_ptr);
+		state->end_ptr = png_create_info_struct(state->png_ptr);
+		if (setjmp(png_jmpbuf(state->png_ptr))) {
+			abandon();
+			return false;
 		}
-		png_read_end(png_ptr, end_ptr);
-		png_destroy_read_struct(&png_ptr, &info_ptr, &end_ptr);
+		if (map)
+			png_set_read_fn(state->png_ptr, state, png_read_mapped);
+		else
+			png_init_io(state->png_ptr, f);
+		png_read_info(state->png_ptr, state->info_ptr);
+		png_set_expand(state->png_ptr);
+		png_set_strip_alpha(state->png_ptr);
+		png_set_strip_16(state->png_ptr);
+		png_set_gray_to_rgb(state->png_ptr);
+		width = png_get_image_width(state->png_ptr, state->info_ptr);
+		height = png_get_image_height(state->png_ptr, state->info_ptr);
 	} else {
 		/* Not JPEG or PNG */
 		fprintf(stderr, "Unsupported file type in %s\n", filename.c_str());
+#ifndef WIN32
+		if (map)
+			munmap((void *) map, mapSize);
+#endif
+		if (f != stdin)
+			fclose(f);
 		return false;
 	}
-	fclose(f);
+	row = 0;
+	return true;
+}
+
+
+// Decode the next row into w() pixels.  Returns false past the last row,
+// or if the file is corrupt or cut short, after which the file is closed.
+bool ImReader::readRow(Color *pixels)
+{
+	if (!state || row >= height)
+		return false;
+	if (state->jpeg) {
+		if (setjmp(state->jpeg_jmp)) {
+			abandon();
+			return false;
+		}
+		JSAMPROW rowptr = (JSAMPROW) pixels;
+		jpeg_read_scanlines(&state->cinfo, &rowptr, 1);
+	} else {
+		if (setjmp(png_jmpbuf(state->png_ptr))) {
+			abandon();
+			return false;
+		}
+		png_read_row(state->png_ptr, (png_bytep) pixels, NULL);
+	}
+	row++;
+	return true;
+}
+
+
+// Close the file, whether or not every row was read
+void ImReader::close()
+{
+	if (!state)
+		return;
+	bool done = (row == height);
+	if (state->jpeg) {
+		if (done)
+			jpeg_finish_decompress(&state->cinfo);
+		jpeg_destroy_decompress(&state->cinfo);
+	} else {
+		if (done)
+			png_read_end(state->png_ptr, state->end_ptr);
+		png_destroy_read_struct(&state->png_ptr, &state->info_ptr,
+			&state->end_ptr);
+	}
+#ifndef WIN32
+	if (state->map)
+		munmap((void *) state->map, state->mapSize);
+#endif
+	if (state->f != stdin)
+		fclose(state->f);
+	delete state;
+	state = 0;
+	width = height = row = 0;
+}
+
+
+// Close the file after a decoding error, without finishing the decoder
+void ImReader::abandon()
+{
+	row = -1;
+	close();
+}
+
+
+// Read an Im from a file.  Returns true if succeeded, else false.
+bool Im::read(const ::std::string &filename)
+{
+	ImReader in;
+	if (!in.open(filename))
+		return false;
+	width = in.w();
+	height = in.h();
+	pixels.resize(w() * h());
+	for (int i = 0; i < h(); i++)
+		if (!in.readRow(&pixels[i * w()]))
+			return false;
+	in.close();
 	return true;
 }
 
@@ -96,60 +258,141 @@ static inline bool ends_with(const char *s1, const char *s2)
 }
 
 
-// Write an Im to a file.  Returns true if succeeded, else false.
-bool Im::write(const ::std::string &filename)
+// State of a file being written: one of the two encoders
+struct ImWriterState {
+	FILE *f;
+	bool jpeg;
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	png_structp png_ptr;
+	png_infop info_ptr;
+};
+
+
+// Create a file for a width x height image.  Returns true if succeeded,
+// else false.
+bool ImWriter::open(const ::std::string &filename, int width_, int height_,
+	ImEncode encode)
 {
 	using namespace std;
 
+	close();
 	FILE *f = !strcmp(filename.c_str(), "-") ? stdout :
 		fopen(filename.c_str(), "wb");
 	if (!f) {
 		fprintf(stderr, "Couldn't open file %s\n", filename.c_str());
 		return false;
 	}
+	width = width_;
+	height = height_;
+	row = 0;
+	state = new ImWriterState;
+	state->f = f;
 
 	if (ends_with(filename.c_str(), ".jpg") ||
 	    ends_with(filename.c_str(), ".jpeg")) {
 		/* Write JPEG */
-		struct jpeg_compress_struct cinfo;
-		struct jpeg_error_mgr jerr;
-		cinfo.err = jpeg_std_error(&jerr);
+		state->jpeg = true;
+		struct jpeg_compress_struct &cinfo = state->cinfo;
+		cinfo.err = jpeg_std_error(&state->jerr);
 		jpeg_create_compress(&cinfo);
-		cinfo.image_width = w();
-		cinfo.image_height = h();
+		cinfo.image_width = width;
+		cinfo.image_height = height;
 		cinfo.input_components = 3;
 		cinfo.in_color_space = JCS_RGB;
 		jpeg_set_defaults(&cinfo);
 		jpeg_set_quality(&cinfo, 90, TRUE);
 		cinfo.optimize_coding = TRUE;
 		cinfo.dct_method = JDCT_FLOAT;
+		if (encode == IM_ENCODE_FASTEST) {
+			/* One pass with the standard tables */
+			cinfo.optimize_coding = FALSE;
+			cinfo.dct_method = JDCT_IFAST;
+		} else if (encode == IM_ENCODE_BALANCED) {
+			cinfo.optimize_coding = FALSE;
+			cinfo.dct_method = JDCT_ISLOW;
+		} else if (encode == IM_ENCODE_SMALLEST) {
+			cinfo.dct_method = JDCT_ISLOW;
+		}
 		cinfo.comp_info[0].h_samp_factor = 1;
 		cinfo.comp_info[0].v_samp_factor = 1;
 		jpeg_stdio_dest(&cinfo, f);
 		jpeg_start_compress(&cinfo, TRUE);
-		for (int i = 0; i < h(); i++) {
-			JSAMPROW rowptr = (JSAMPROW) &pixels[i * w()];
-			jpeg_write_scanlines(&cinfo, &rowptr, 1);
-		}
-		jpeg_finish_compress(&cinfo);
-		jpeg_destroy_compress(&cinfo);
 	} else {
 		/* Write PNG */
-		png_structp png_ptr =
+		state->jpeg = false;
+		state->png_ptr =
 			png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
-		png_infop info_ptr = png_create_info_struct(png_ptr);
-		png_init_io(png_ptr, f);
-		png_set_IHDR(png_ptr, info_ptr, w(), h(), 8,
+		state->info_ptr = png_create_info_struct(state->png_ptr);
+		png_init_io(state->png_ptr, f);
+		png_set_IHDR(state->png_ptr, state->info_ptr, width, height, 8,
 			PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
 			PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-		png_write_info(png_ptr, info_ptr);
-		for (int i = 0; i < h(); i++) {
-			png_bytep row_pointer = (png_bytep) &pixels[i * w()];
-			png_write_row(png_ptr, row_pointer);
+		if (encode == IM_ENCODE_FASTEST) {
+			png_set_compression_level(state->png_ptr, 1);
+			png_set_filter(state->png_ptr, 0, PNG_FILTER_SUB);
+		} else if (encode == IM_ENCODE_BALANCED) {
+			png_set_compression_level(state->png_ptr, 4);
+			png_set_filter(state->png_ptr, 0,
+				PNG_FILTER_SUB | PNG_FILTER_UP);
+		} else if (encode == IM_ENCODE_SMALLEST) {
+			png_set_compression_level(state->png_ptr, 9);
+			png_set_filter(state->png_ptr, 0, PNG_ALL_FILTERS);
 		}
-		png_write_end(png_ptr, info_ptr);
-		png_destroy_write_struct(&png_ptr, &info_ptr);
+		png_write_info(state->png_ptr, state->info_ptr);
+	}
+	return true;
+}
+
+
+// Encode the next row of w() pixels
+bool ImWriter::writeRow(const Color *pixels)
+{
+	if (!state || row >= height)
+		return false;
+	if (state->jpeg) {
+		JSAMPROW rowptr = (JSAMPROW) pixels;
+		jpeg_write_scanlines(&state->cinfo, &rowptr, 1);
+	} else {
+		png_write_row(state->png_ptr, (png_bytep) pixels);
 	}
-	fclose(f);
+	row++;
 	return true;
 }
+
+
+// Finish the file, which must have had every row written.  Returns true if
+// succeeded, else false.
+bool ImWriter::close()
+{
+	if (!state)
+		return false;
+	bool done = (row == height);
+	if (state->jpeg) {
+		if (done)
+			jpeg_finish_compress(&state->cinfo);
+		jpeg_destroy_compress(&state->cinfo);
+	} else {
+		if (done)
+			png_write_end(state->png_ptr, state->info_ptr);
+		png_destroy_write_struct(&state->png_ptr, &state->info_ptr);
+	}
+	if (state->f != stdout)
+		fclose(state->f);
+	delete state;
+	state = 0;
+	width = height = row = 0;
+	return done;
+}
+
+
+// Write an Im to a file.  Returns true if succeeded, else false.
+bool Im::write(const ::std::string &filename, ImEncode encode)
+{
+	ImWriter out;
+	if (!out.open(filename, w(), h(), encode))
+		return false;
+	for (int i = 0; i < h(); i++)
+		out.writeRow(&pixels[i * w()]);
+	return out.close();
+}
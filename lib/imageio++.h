@@ -23,6 +23,17 @@ struct Color {
 };
 
 
+// Encoder settings, trading encode time against file size.  The default is
+// what write() has always done: optimized JPEG Huffman tables and a float
+// DCT, and libpng's default zlib level and adaptive filtering.
+enum ImEncode {
+	IM_ENCODE_DEFAULT,
+	IM_ENCODE_FASTEST,	// zlib level 1, Sub filter; fast DCT, standard tables
+	IM_ENCODE_BALANCED,	// zlib level 4, Sub and Up filters; integer DCT
+	IM_ENCODE_SMALLEST	// zlib level 9, all filters; optimized tables
+};
+
+
 // Class defining an image: width, height, and pixels
 class Im {
 public:
@@ -53,8 +64,10 @@ public:
 	// Read an Im from a file.  Returns true if succeeded, else false.
 	bool read(const ::std::string &filename);
 
-	// Write an Im to a file.  Returns true if succeeded, else false.
-	bool write(const ::std::string &filename);
+	// Write an Im to a file, JPEG or PNG by extension.  Returns true if
+	// succeeded, else false.
+	bool write(const ::std::string &filename,
+		ImEncode encode = IM_ENCODE_DEFAULT);
 
 private:
 	int width, height;
@@ -62,4 +75,74 @@ private:
 
 };
 
+
+// Reads a JPEG or PNG file one row at a time, for images too large to hold
+struct ImReaderState;
+class ImReader {
+public:
+	ImReader() : state(0), width(0), height(0), row(0)
+		{}
+	~ImReader()
+		{ close(); }
+
+	// Open a file and read its header.  Returns true if succeeded, else false.
+	bool open(const ::std::string &filename);
+
+	// Size of the image, once open
+	int w() const
+		{ return width; }
+	int h() const
+		{ return height; }
+
+	// Decode the next row into w() pixels.  Returns false past the last row,
+	// or if the file is corrupt or cut short, after which the file is closed.
+	bool readRow(Color *pixels);
+
+	// Number of rows read so far
+	int rowsRead() const
+		{ return row; }
+
+	// Close the file, whether or not every row was read
+	void close();
+
+private:
+	ImReaderState *state;
+	int width, height, row;
+
+	void abandon();
+
+	ImReader(const ImReader &);
+	ImReader &operator = (const ImReader &);
+};
+
+
+// Writes a JPEG or PNG file, by extension, one row at a time
+struct ImWriterState;
+class ImWriter {
+public:
+	ImWriter() : state(0), width(0), height(0), row(0)
+		{}
+	~ImWriter()
+		{ close(); }
+
+	// Create a file for a width x height image.  Returns true if succeeded,
+	// else false.
+	bool open(const ::std::string &filename, int width, int height,
+		ImEncode encode = IM_ENCODE_DEFAULT);
+
+	// Encode the next row of w() pixels
+	bool writeRow(const Color *pixels);
+
+	// Finish the file, which must have had every row written.  Returns true
+	// if succeeded, else false.
+	bool close();
+
+private:
+	ImWriterState *state;
+	int width, height, row;
+
+	ImWriter(const ImWriter &);
+	ImWriter &operator = (const ImWriter &);
+};
+
 #endif
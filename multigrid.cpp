@@ -0,0 +1,530 @@
+/*
+multigrid.cpp
+Geometric multigrid (V-cycle and FMG) solver for the Poisson system over Omega.
+
+Levels are cell-centered: coarse cell (I, J) covers fine cells 2I-1..2I by
+2J-1..2J.  A coarse cell is fixed if any of its children is, otherwise an
+unknown if any of its children is, and every level is rediscretized with the
+same 5-point stencil as the finest one.  Corrections are prolonged bilinearly
+(fixed cells contribute zero, absent cells mirror their neighbor) and
+residuals are restricted with the transpose, which also absorbs the h^2
+scaling of the integer stencil.  The smoother is red-black Gauss-Seidel.
+
+Because the Dirichlet boundary creeps inwards on coarse levels, plain V-cycles
+converge slowly near the mask edge.  The V-cycle is symmetric, so it is used
+as a preconditioner for conjugate gradients instead, which restores
+mesh-independent convergence on irregular masks.
+
+Several right-hand sides (the color channels) are solved together: every
+field stores the values of all channels of a cell next to each other, so a
+single pass over the grid serves them all.  Given a thread pool, smoothing,
+residuals, prolongation and the CG vector operations are split by rows (or
+cells) between threads; restriction scatters into the coarse grid and stays
+sequential.
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <gsl/gsl_errno.h>
+
+#include "multigrid.h"
+
+// Smoothing sweeps before and after each coarse grid correction
+static const int PRE_SWEEPS = 2;
+static const int POST_SWEEPS = 2;
+
+// Gauss-Seidel sweeps (each way) used to solve the coarsest level
+static const int COARSEST_SWEEPS = 16;
+
+// Stop coarsening once a level has at most this many unknowns
+static const int COARSEST_UNKNOWNS = 32;
+
+// Cells per chunk below which a loop is not worth splitting between threads
+static const int GRAIN_CELLS = 4096;
+
+/* Rows per chunk for a parallel loop over the rows of a level */
+static inline int rowGrain(const MGLevel &l)
+{
+  return GRAIN_CELLS / l.nx + 1;
+}
+
+/* Type of a coarse cell from its four children: fixed wins over unknown, which
+* wins over absent, so the Dirichlet condition is never coarsened away */
+static inline unsigned char coarsenType(unsigned char a, unsigned char b, unsigned char c, unsigned char d)
+{
+  if (a == MG_FIXED || b == MG_FIXED || c == MG_FIXED || d == MG_FIXED) return MG_FIXED;
+  if (a == MG_UNKNOWN || b == MG_UNKNOWN || c == MG_UNKNOWN || d == MG_UNKNOWN) return MG_UNKNOWN;
+  return MG_ABSENT;
+}
+
+/* Ghost ring cells are fixed if the pixels they cover reach into the image, so
+* that Omega keeps its Dirichlet boundary on coarse levels.  Cell i of a level
+* with the given scale covers pixels x0 + (i-1)*scale .. x0 + i*scale - 1 */
+static void markGhosts(MGLevel &l, int scale, int x0, int y0, int W, int H)
+{
+  int s = l.stride();
+  for (int j = 0; j <= l.ny + 1; j++) {
+    for (int i = 0; i <= l.nx + 1; i++) {
+      if (i != 0 && j != 0 && i != l.nx + 1 && j != l.ny + 1) continue;
+      bool inX = x0 + i * scale - 1 >= 0 && x0 + (i - 1) * scale <= W - 1;
+      bool inY = y0 + j * scale - 1 >= 0 && y0 + (j - 1) * scale <= H - 1;
+      l.type[i + j * s] = (inX && inY) ? MG_FIXED : MG_ABSENT;
+    }
+  }
+}
+
+/* Fill in Np for every unknown cell of a level */
+static void computeDiag(MGLevel &l)
+{
+  int s = l.stride();
+  for (int j = 1; j <= l.ny; j++) {
+    for (int i = 1; i <= l.nx; i++) {
+      int c = i + j * s;
+      if (l.type[c] != MG_UNKNOWN) continue;
+      l.diag[c] = (l.type[c - 1] != MG_ABSENT) + (l.type[c + 1] != MG_ABSENT) +
+                  (l.type[c - s] != MG_ABSENT) + (l.type[c + s] != MG_ABSENT);
+    }
+  }
+}
+
+/* Allocate the per-cell vectors of a level, with nrhs values per cell in the fields */
+static void allocLevel(MGLevel &l, int nrhs)
+{
+  size_t n = (size_t) (l.nx + 2) * (l.ny + 2);
+  l.type.assign(n, MG_ABSENT);
+  l.diag.assign(n, 0);
+  l.u.assign(n * nrhs, 0.0);
+  l.f.assign(n * nrhs, 0.0);
+  l.r.assign(n * nrhs, 0.0);
+}
+
+Multigrid::Multigrid(const ::std::vector<int> &toMask, int W, int H, int nrhs_, ThreadPool *pool_)
+  : nrhs(nrhs_), pool(pool_), history(NULL)
+{
+  int OMEGA_SIZE = toMask.size();
+  if (OMEGA_SIZE == 0) return;
+
+  /* Bounding box of Omega grown by one pixel for its boundary */
+  int x0 = W, y0 = H, x1 = -1, y1 = -1;
+  for (int id = 0; id < OMEGA_SIZE; id++) {
+    int px = toMask[id] % W;
+    int py = toMask[id] / W;
+    x0 = ::std::min(x0, px);
+    x1 = ::std::max(x1, px);
+    y0 = ::std::min(y0, py);
+    y1 = ::std::max(y1, py);
+  }
+  x0 = ::std::max(x0 - 1, 0);
+  y0 = ::std::max(y0 - 1, 0);
+  x1 = ::std::min(x1 + 1, W - 1);
+  y1 = ::std::min(y1 + 1, H - 1);
+
+  /* Finest level mirrors the image: every cell in the box lies in the image,
+  *  and unknowns only touch the ghost ring where it is outside the image */
+  MGLevel fine;
+  fine.nx = x1 - x0 + 1;
+  fine.ny = y1 - y0 + 1;
+  allocLevel(fine, nrhs);
+  int s = fine.stride();
+  for (int j = 1; j <= fine.ny; j++) {
+    for (int i = 1; i <= fine.nx; i++) {
+      fine.type[i + j * s] = MG_FIXED;
+    }
+  }
+  markGhosts(fine, 1, x0, y0, W, H);
+  toCell.resize(OMEGA_SIZE);
+  for (int id = 0; id < OMEGA_SIZE; id++) {
+    int px = toMask[id] % W;
+    int py = toMask[id] / W;
+    int c = (px - x0 + 1) + (py - y0 + 1) * s;
+    fine.type[c] = MG_UNKNOWN;
+    toCell[id] = c;
+  }
+  computeDiag(fine);
+  hierarchy.push_back(fine);
+
+  /* Coarsen until the problem is trivially small */
+  int unknowns = OMEGA_SIZE;
+  int scale = 1;
+  while (unknowns > COARSEST_UNKNOWNS && (hierarchy.back().nx > 2 || hierarchy.back().ny > 2)) {
+    const MGLevel &f = hierarchy.back();
+    int fs = f.stride();
+    MGLevel coarse;
+    coarse.nx = (f.nx + 1) / 2;
+    coarse.ny = (f.ny + 1) / 2;
+    allocLevel(coarse, nrhs);
+    int cs = coarse.stride();
+    unknowns = 0;
+    for (int J = 1; J <= coarse.ny; J++) {
+      for (int I = 1; I <= coarse.nx; I++) {
+        int fc = (2 * I - 1) + (2 * J - 1) * fs;
+        unsigned char t = coarsenType(f.type[fc], f.type[fc + 1], f.type[fc + fs], f.type[fc + fs + 1]);
+        coarse.type[I + J * cs] = t;
+        if (t == MG_UNKNOWN) unknowns++;
+      }
+    }
+    if (unknowns == 0) break;
+    scale *= 2;
+    markGhosts(coarse, scale, x0, y0, W, H);
+    computeDiag(coarse);
+    hierarchy.push_back(coarse);
+  }
+}
+
+/* Red-black Gauss-Seidel; reverse swaps the color order so that pre- and
+* post-smoothing are adjoint to each other.  Cells of one color only read the
+* other color, so the rows of a pass are split between threads. */
+void Multigrid::smooth(MGLevel &l, int sweeps, bool reverse)
+{
+  int s = l.stride();
+  int K = nrhs;
+  const unsigned char *type = &l.type[0];
+  const unsigned char *diag = &l.diag[0];
+  const double *f = &l.f[0];
+  double *u = &l.u[0];
+
+  for (int k = 0; k < sweeps; k++) {
+    for (int pass = 0; pass < 2; pass++) {
+      int color = reverse ? 1 - pass : pass;
+      parallelFor(pool, l.ny, rowGrain(l), [&](int begin, int end) {
+        for (int j = begin + 1; j <= end; j++) {
+          for (int i = 1 + ((j + 1 + color) & 1); i <= l.nx; i += 2) {
+            int c = i + j * s;
+            if (type[c] != MG_UNKNOWN) continue;
+            for (int a = c * K; a < (c + 1) * K; a++) {
+              u[a] = (f[a] + u[a - K] + u[a + K] + u[a - s * K] + u[a + s * K]) / diag[c];
+            }
+          }
+        }
+      });
+    }
+  }
+}
+
+/* out = Av on the unknown cells of a level (v is zero elsewhere), for K
+* interleaved right-hand sides; with f set, out = f - Av instead */
+static void applyStencil(ThreadPool *pool, const MGLevel &l, int K, const double *v, double *out,
+                         const double *f = NULL)
+{
+  int s = l.stride();
+  parallelFor(pool, l.ny, rowGrain(l), [&](int begin, int end) {
+    for (int j = begin + 1; j <= end; j++) {
+      for (int i = 1; i <= l.nx; i++) {
+        int c = i + j * s;
+        if (l.type[c] != MG_UNKNOWN) continue;
+        for (int a = c * K; a < (c + 1) * K; a++) {
+          double Av = l.diag[c] * v[a] - v[a - K] - v[a + K] - v[a - s * K] - v[a + s * K];
+          out[a] = f ? f[a] - Av : Av;
+        }
+      }
+    }
+  });
+}
+
+/* r = f - Au on unknown cells */
+void Multigrid::residual(MGLevel &l)
+{
+  applyStencil(pool, l, nrhs, &l.u[0], &l.r[0], &l.f[0]);
+}
+
+/* Bilinear interpolation stencil of fine cell (i, j): the coarse cells it reads
+* and their weights.  Fixed coarse cells get weight zero and absent ones fold
+* their weight onto the parent.  Returns false if the parent is not an
+* unknown, in which case the cell is left to the smoother. */
+static inline bool interpStencil(const MGLevel &coarse, int i, int j, int cell[4], double weight[4])
+{
+  int cs = coarse.stride();
+  int C = (i + 1) / 2 + ((j + 1) / 2) * cs;
+  if (coarse.type[C] != MG_UNKNOWN) return false;
+  int di = (i & 1) ? -1 : 1;
+  int dj = (j & 1) ? -cs : cs;
+
+  cell[0] = C;
+  cell[1] = C + di;
+  cell[2] = C + dj;
+  cell[3] = C + di + dj;
+  weight[0] = 9.0;
+  weight[1] = 3.0;
+  weight[2] = 3.0;
+  weight[3] = 1.0;
+  for (int k = 1; k < 4; k++) {
+    unsigned char t = coarse.type[cell[k]];
+    if (t == MG_FIXED) {
+      weight[k] = 0.0;
+    } else if (t == MG_ABSENT) {
+      weight[0] += weight[k];
+      weight[k] = 0.0;
+    }
+  }
+  for (int k = 0; k < 4; k++) {
+    weight[k] /= 16.0;
+  }
+  return true;
+}
+
+/* coarse.f = transpose of the interpolation applied to field; resets coarse.u */
+void Multigrid::restrict_field(const ::std::vector<double> &field, MGLevel &fine, MGLevel &coarse)
+{
+  ::std::fill(coarse.u.begin(), coarse.u.end(), 0.0);
+  ::std::fill(coarse.f.begin(), coarse.f.end(), 0.0);
+
+  int fs = fine.stride();
+  int cell[4];
+  double weight[4];
+  for (int j = 1; j <= fine.ny; j++) {
+    for (int i = 1; i <= fine.nx; i++) {
+      int c = i + j * fs;
+      if (fine.type[c] != MG_UNKNOWN || !interpStencil(coarse, i, j, cell, weight)) continue;
+      for (int k = 0; k < 4; k++) {
+        for (int m = 0; m < nrhs; m++) {
+          coarse.f[cell[k] * nrhs + m] += weight[k] * field[c * nrhs + m];
+        }
+      }
+    }
+  }
+}
+
+/* fine.u += bilinear interpolation of coarse.u */
+void Multigrid::prolong_correct(MGLevel &coarse, MGLevel &fine)
+{
+  int fs = fine.stride();
+  parallelFor(pool, fine.ny, rowGrain(fine), [&](int begin, int end) {
+    int cell[4];
+    double weight[4];
+    for (int j = begin + 1; j <= end; j++) {
+      for (int i = 1; i <= fine.nx; i++) {
+        int c = i + j * fs;
+        if (fine.type[c] != MG_UNKNOWN || !interpStencil(coarse, i, j, cell, weight)) continue;
+        for (int m = 0; m < nrhs; m++) {
+          fine.u[c * nrhs + m] += weight[0] * coarse.u[cell[0] * nrhs + m] + weight[1] * coarse.u[cell[1] * nrhs + m] +
+                                  weight[2] * coarse.u[cell[2] * nrhs + m] + weight[3] * coarse.u[cell[3] * nrhs + m];
+        }
+      }
+    }
+  });
+}
+
+/* Solve the coarsest level with a fixed, symmetric number of sweeps so that the
+* V-cycle stays a linear, symmetric operator */
+void Multigrid::solve_coarsest(MGLevel &l)
+{
+  smooth(l, COARSEST_SWEEPS, false);
+  smooth(l, COARSEST_SWEEPS, true);
+}
+
+/* One V-cycle on the problem held by hierarchy[level] */
+void Multigrid::vcycle(int level)
+{
+  MGLevel &l = hierarchy[level];
+  if (level == levels() - 1) {
+    solve_coarsest(l);
+    return;
+  }
+
+  MGLevel &coarse = hierarchy[level + 1];
+  smooth(l, PRE_SWEEPS, false);
+  residual(l);
+  restrict_field(l.r, l, coarse);
+  vcycle(level + 1);
+  prolong_correct(coarse, l);
+  smooth(l, POST_SWEEPS, true);
+}
+
+/* z = one V-cycle applied to r with a zero initial guess */
+void Multigrid::precondition(const ::std::vector<double> &r, ::std::vector<double> &z)
+{
+  MGLevel &l = hierarchy[0];
+  l.f = r;
+  ::std::fill(l.u.begin(), l.u.end(), 0.0);
+  vcycle(0);
+  z = l.u;
+}
+
+/* Full multigrid for Ae = r: solve on the coarsest level, then interpolate and
+* run one V-cycle on every finer level */
+void Multigrid::fmg(const ::std::vector<double> &r, ::std::vector<double> &e)
+{
+  hierarchy[0].f = r;
+  for (int k = 0; k + 1 < levels(); k++) {
+    restrict_field(hierarchy[k].f, hierarchy[k], hierarchy[k + 1]);
+  }
+  solve_coarsest(hierarchy[levels() - 1]);
+  for (int k = levels() - 2; k >= 0; k--) {
+    ::std::fill(hierarchy[k].u.begin(), hierarchy[k].u.end(), 0.0);
+    prolong_correct(hierarchy[k + 1], hierarchy[k]);
+    vcycle(k);
+  }
+  e = hierarchy[0].u;
+}
+
+/* Per right-hand side dot products of two interleaved fields.  With a pool,
+* each chunk of cells sums its part and the partial sums are added in chunk
+* order, so the result only depends on the number of chunks. */
+static void dots(ThreadPool *pool, const ::std::vector<double> &a, const ::std::vector<double> &b, int K, double *out)
+{
+  int cells = a.size() / K;
+  int chunks = chunkCount(pool, cells, GRAIN_CELLS);
+  ::std::vector<double> partial(chunks * K, 0.0);
+  runChunks(pool, chunks, [&](int ch) {
+    double *sum = &partial[ch * K];
+    for (int c = chunkBegin(cells, chunks, ch) * K; c < chunkBegin(cells, chunks, ch + 1) * K; c += K) {
+      for (int k = 0; k < K; k++) {
+        sum[k] += a[c + k] * b[c + k];
+      }
+    }
+  });
+  for (int k = 0; k < K; k++) {
+    out[k] = partial[k];
+    for (int ch = 1; ch < chunks; ch++) {
+      out[k] += partial[ch * K + k];
+    }
+  }
+}
+
+/* Residual norm relative to the norm of its right-hand side */
+static inline double relative(double residual, double bnorm)
+{
+  return bnorm > 0.0 ? residual / bnorm : residual;
+}
+
+/* Print one residual norm per right-hand side */
+static void printResiduals(const char *label, const ::std::vector<double> &res)
+{
+  fprintf(stderr, "%s residual =", label);
+  for (size_t k = 0; k < res.size(); k++) {
+    fprintf(stderr, " %.12e", res[k]);
+  }
+  fprintf(stderr, "\n");
+}
+
+int Multigrid::solve(gsl_vector *x, const gsl_vector *b, double tol, int max_cycles, bool use_fmg, int *cycles)
+{
+  int K = nrhs;
+  for (int k = 0; k < K; k++) {
+    cycles[k] = 0;
+  }
+  int OMEGA_SIZE = toCell.size();
+  if (OMEGA_SIZE == 0) return GSL_SUCCESS;
+  MGLevel &l = hierarchy[0];
+  size_t n = l.u.size();
+
+  /* Scatter the system onto the finest grid; cells outside Omega stay zero */
+  ::std::vector<double> u(n, 0.0), f(n, 0.0), r(n, 0.0), z(n, 0.0), p(n), q(n, 0.0);
+  for (int id = 0; id < OMEGA_SIZE; id++) {
+    for (int k = 0; k < K; k++) {
+      f[toCell[id] * K + k] = gsl_vector_get(b, id * K + k);
+      u[toCell[id] * K + k] = gsl_vector_get(x, id * K + k);
+    }
+  }
+  ::std::vector<double> bnorm(K), res(K), rz(K), pq(K), rz_new(K);
+  ::std::vector<double> alpha(K), beta(K);
+  dots(pool, f, f, K, &bnorm[0]);
+  for (int k = 0; k < K; k++) {
+    bnorm[k] = sqrt(bnorm[k]);
+  }
+
+  /* r = f - Au */
+  applyStencil(pool, l, K, &u[0], &r[0], &f[0]);
+  dots(pool, r, r, K, &res[0]);
+
+  /* Right-hand sides that have converged stop being updated (zero step) */
+  ::std::vector<bool> done(K);
+  int remaining = K;
+  for (int k = 0; k < K; k++) {
+    res[k] = sqrt(res[k]);
+    done[k] = res[k] <= tol * bnorm[k];
+    if (done[k]) remaining--;
+    if (history) history[k].push_back(relative(res[k], bnorm[k]));
+  }
+
+  /* Full multigrid on the residual equation for a better start */
+  if (use_fmg && remaining > 0) {
+    fmg(r, z);
+    applyStencil(pool, l, K, &z[0], &q[0]);
+    for (size_t c = 0; c < n; c += K) {
+      for (int k = 0; k < K; k++) {
+        if (done[k]) continue;
+        u[c + k] += z[c + k];
+        r[c + k] -= q[c + k];
+      }
+    }
+    dots(pool, r, r, K, &res[0]);
+    for (int k = 0; k < K; k++) {
+      res[k] = sqrt(res[k]);
+      if (history && !done[k]) history[k].push_back(relative(res[k], bnorm[k]));
+      if (!done[k] && res[k] <= tol * bnorm[k]) {
+        done[k] = true;
+        remaining--;
+      }
+    }
+  }
+
+  /* Conjugate gradients preconditioned with one V-cycle */
+  if (remaining > 0) {
+    precondition(r, z);
+    p = z;
+    dots(pool, r, z, K, &rz[0]);
+    for (int cycle = 1; cycle <= max_cycles && remaining > 0; cycle++) {
+      applyStencil(pool, l, K, &p[0], &q[0]);
+      dots(pool, p, q, K, &pq[0]);
+      for (int k = 0; k < K; k++) {
+        alpha[k] = done[k] ? 0.0 : rz[k] / pq[k];
+      }
+      parallelFor(pool, n / K, GRAIN_CELLS, [&](int begin, int end) {
+        for (int c = begin * K; c < end * K; c += K) {
+          for (int k = 0; k < K; k++) {
+            u[c + k] += alpha[k] * p[c + k];
+            r[c + k] -= alpha[k] * q[c + k];
+          }
+        }
+      });
+      dots(pool, r, r, K, &res[0]);
+      for (int k = 0; k < K; k++) {
+        res[k] = sqrt(res[k]);
+        if (done[k]) continue;
+        cycles[k] = cycle;
+        if (history) history[k].push_back(relative(res[k], bnorm[k]));
+        if (res[k] <= tol * bnorm[k]) {
+          done[k] = true;
+          remaining--;
+        }
+      }
+
+      /* print out residual norm ||A*x - b||, as the other iterative solvers do */
+      if (cycle % 100 == 0) {
+        char label[32];
+        sprintf(label, "cycle %d", cycle);
+        printResiduals(label, res);
+      }
+      if (remaining == 0) break;
+
+      precondition(r, z);
+      dots(pool, r, z, K, &rz_new[0]);
+      for (int k = 0; k < K; k++) {
+        beta[k] = done[k] ? 0.0 : rz_new[k] / rz[k];
+      }
+      parallelFor(pool, n / K, GRAIN_CELLS, [&](int begin, int end) {
+        for (int c = begin * K; c < end * K; c += K) {
+          for (int k = 0; k < K; k++) {
+            p[c + k] = z[c + k] + beta[k] * p[c + k];
+          }
+        }
+      });
+      rz = rz_new;
+    }
+  }
+
+  /* Gather the solution */
+  for (int id = 0; id < OMEGA_SIZE; id++) {
+    for (int k = 0; k < K; k++) {
+      gsl_vector_set(x, id * K + k, u[toCell[id] * K + k]);
+    }
+  }
+
+  if (remaining == 0) {
+    fprintf(stderr, "Converged\n");
+    return GSL_SUCCESS;
+  }
+  return GSL_CONTINUE;
+}
@@ -0,0 +1,79 @@
+#ifndef MULTIGRID_H
+#define MULTIGRID_H
+/*
+multigrid.h
+Geometric multigrid (V-cycle and FMG) solver for the Poisson system over Omega.
+Works on the pixel grid itself rather than on a sparse matrix: every level is a
+padded grid of cells tagged as unknown (in Omega), fixed (in the image but not
+in Omega) or absent (outside the image), so irregular mask boundaries need no
+special casing.
+*/
+
+#include <vector>
+#include <gsl/gsl_vector.h>
+
+#include "threadpool.h"
+
+
+// Cell types on a multigrid level
+enum { MG_ABSENT = 0, MG_FIXED = 1, MG_UNKNOWN = 2 };
+
+// One level of the hierarchy: an (nx + 2) x (ny + 2) grid, including a ring of
+// cells outside Omega so that stencils never need bounds checks
+struct MGLevel {
+  int nx, ny;
+  ::std::vector<unsigned char> type;
+  ::std::vector<unsigned char> diag;  // Np for unknown cells, 0 otherwise
+  ::std::vector<double> u, f, r;      // one value per right-hand side per cell
+
+  int stride() const
+    { return nx + 2; }
+};
+
+
+// Multigrid solver for the Omega system of an image of size W x H
+class Multigrid {
+public:
+  // Build the hierarchy for nrhs simultaneous right-hand sides; toMask maps
+  // Omega IDs to pixel indices.  If set, pool (which must outlive the solver)
+  // runs the grid sweeps in parallel.
+  Multigrid(const ::std::vector<int> &toMask, int W, int H, int nrhs = 1, ThreadPool *pool = NULL);
+
+  // Solve Ax = b for every right-hand side to relative tolerance tol
+  // (||Ax - b|| <= tol * ||b||), starting from x, with at most max_cycles
+  // V-cycle preconditioned CG iterations.  x and b interleave the right-hand
+  // sides (entry id * nrhs + k), and each one stops once it has converged.
+  // With use_fmg set, a full multigrid pass on the residual equation refines
+  // x first.  Returns a GSL status code and the cycles taken by each
+  // right-hand side in cycles.
+  int solve(gsl_vector *x, const gsl_vector *b, double tol, int max_cycles, bool use_fmg, int *cycles);
+
+  // Number of levels in the hierarchy
+  int levels() const
+    { return (int) hierarchy.size(); }
+
+  // Have solve append the relative residual ||Ax - b|| / ||b|| of each
+  // right-hand side k to history[k], before the first cycle, after the full
+  // multigrid pass and after each cycle until it converges.  NULL (the
+  // default) records nothing
+  void recordResiduals(::std::vector<double> *history_)
+    { history = history_; }
+
+private:
+  int nrhs;
+  ThreadPool *pool;
+  ::std::vector<double> *history;
+  ::std::vector<MGLevel> hierarchy;
+  ::std::vector<int> toCell;  // Omega ID -> cell index on the finest level
+
+  void smooth(MGLevel &l, int sweeps, bool reverse);
+  void residual(MGLevel &l);
+  void restrict_field(const ::std::vector<double> &field, MGLevel &fine, MGLevel &coarse);
+  void prolong_correct(MGLevel &coarse, MGLevel &fine);
+  void vcycle(int level);
+  void solve_coarsest(MGLevel &l);
+  void precondition(const ::std::vector<double> &r, ::std::vector<double> &z);
+  void fmg(const ::std::vector<double> &r, ::std::vector<double> &e);
+};
+
+#endif
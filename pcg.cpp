@@ -0,0 +1,417 @@
+/*
+pcg.cpp
+Preconditioned conjugate gradients for the Poisson system over Omega.
+Products and triangular sweeps run on the matrix-free stencil; only the IC(0)
+factor is stored explicitly.  Products, vector updates and the Jacobi
+preconditioner are split between threads; the IC(0) and SSOR sweeps are
+inherently sequential and stay on the calling thread.
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <gsl/gsl_errno.h>
+
+#include "pcg.h"
+
+// Relaxation factor for the SSOR preconditioner
+static const double SSOR_OMEGA = 1.5;
+
+// Unknowns per chunk below which a vector loop is not worth splitting
+static const int VECTOR_GRAIN = 4096;
+
+// Relative tolerance of each correction solved by refine, well within reach
+// of single precision, and the most corrections it makes
+static const double REFINE_TOL = 1.0e-3;
+static const int REFINE_MAX_STEPS = 10;
+
+// Residual norm relative to the norm of its right-hand side
+static inline double relative(double residual, double bnorm)
+{
+  return bnorm > 0.0 ? residual / bnorm : residual;
+}
+
+template <class Real>
+BasicPCG<Real>::BasicPCG(const Stencil &A_, PrecondType type_, int nrhs_)
+  : A(A_), type(type_), n(A_.size()), nrhs(::std::min(::std::max(nrhs_, 1), PCG_MAX_RHS)), history(NULL)
+{
+  r.resize(n * nrhs);
+  z.resize(n * nrhs);
+  p.resize(n * nrhs);
+  q.resize(n * nrhs);
+
+  if (type == PRECOND_IC0) factor_ic0();
+}
+
+/* Incomplete Cholesky with zero fill-in: L keeps the lower triangle pattern of A */
+template <class Real>
+void BasicPCG<Real>::factor_ic0()
+{
+  /* Copy the lower triangle, diagonal first, rows sorted within each column */
+  Lp.assign(n + 1, 0);
+  int nb[4];
+  for (int j = 0; j < n; j++) {
+    Lp[j + 1] = Lp[j] + 1 + upperNeighbors(j, nb);
+  }
+  Li.resize(Lp[n]);
+  Lx.resize(Lp[n]);
+  for (int j = 0; j < n; j++) {
+    int count = upperNeighbors(j, nb);
+    for (int a = 1; a < count; a++) {
+      for (int b = a; b > 0 && nb[b - 1] > nb[b]; b--) {
+        ::std::swap(nb[b - 1], nb[b]);
+      }
+    }
+    Li[Lp[j]] = j;
+    Lx[Lp[j]] = A.diag(j);
+    for (int m = 0; m < count; m++) {
+      Li[Lp[j] + 1 + m] = nb[m];
+      Lx[Lp[j] + 1 + m] = -1.0;
+    }
+  }
+
+  /* Right-looking factorization, dropping updates outside the pattern */
+  for (int k = 0; k < n; k++) {
+    double d = Lx[Lp[k]];
+    if (d <= 0) {
+      fprintf(stderr, "Warning: IC(0) breakdown at column %d\n", k);
+      d = 1.0;
+    }
+    d = sqrt(d);
+    Lx[Lp[k]] = d;
+    for (int a = Lp[k] + 1; a < Lp[k + 1]; a++) {
+      Lx[a] /= d;
+    }
+    for (int a = Lp[k] + 1; a < Lp[k + 1]; a++) {
+      int i = Li[a];
+      for (int b = a; b < Lp[k + 1]; b++) {
+        int l = Li[b];
+        int *begin = &Li[0] + Lp[i];
+        int *end = &Li[0] + Lp[i + 1];
+        int *pos = ::std::lower_bound(begin, end, l);
+        if (pos != end && *pos == l) Lx[pos - &Li[0]] -= Lx[a] * Lx[b];
+      }
+    }
+  }
+}
+
+/* Omega IDs of the neighbors of j that come before (lower) or after (upper) it */
+template <class Real>
+int BasicPCG<Real>::lowerNeighbors(int j, int *nb) const
+{
+  int count = 0;
+  for (int dir = 0; dir < 4; dir++) {
+    if (A.status(j, dir) == STENCIL_OMEGA && A.neighbor(j, dir) < j) nb[count++] = A.neighbor(j, dir);
+  }
+  return count;
+}
+
+template <class Real>
+int BasicPCG<Real>::upperNeighbors(int j, int *nb) const
+{
+  int count = 0;
+  for (int dir = 0; dir < 4; dir++) {
+    if (A.status(j, dir) == STENCIL_OMEGA && A.neighbor(j, dir) > j) nb[count++] = A.neighbor(j, dir);
+  }
+  return count;
+}
+
+/* out = M^-1 v, for the interleaved right-hand sides */
+template <class Real>
+void BasicPCG<Real>::precondition(const Real *v, Real *out) const
+{
+  int K = nrhs;
+  if (type == PRECOND_JACOBI) {
+    parallelFor(A.threads(), n, VECTOR_GRAIN, [&](int begin, int end) {
+      for (int j = begin; j < end; j++) {
+        for (int k = 0; k < K; k++) {
+          out[j * K + k] = v[j * K + k] / A.diag(j);
+        }
+      }
+    });
+  } else if (type == PRECOND_IC0) {
+    /* L y = v */
+    for (int j = 0; j < n * K; j++) {
+      out[j] = v[j];
+    }
+    for (int j = 0; j < n; j++) {
+      for (int k = 0; k < K; k++) {
+        out[j * K + k] /= Lx[Lp[j]];
+      }
+      for (int a = Lp[j] + 1; a < Lp[j + 1]; a++) {
+        for (int k = 0; k < K; k++) {
+          out[Li[a] * K + k] -= Lx[a] * out[j * K + k];
+        }
+      }
+    }
+    /* L^T out = y */
+    for (int j = n - 1; j >= 0; j--) {
+      for (int k = 0; k < K; k++) {
+        Real sum = out[j * K + k];
+        for (int a = Lp[j] + 1; a < Lp[j + 1]; a++) {
+          sum -= Lx[a] * out[Li[a] * K + k];
+        }
+        out[j * K + k] = sum / Lx[Lp[j]];
+      }
+    }
+  } else {
+    /* (D/w + L) y = v, then y = D/w y, then (D/w + U) out = y */
+    int nb[4];
+    for (int j = 0; j < n; j++) {
+      int count = lowerNeighbors(j, nb);
+      for (int k = 0; k < K; k++) {
+        Real sum = v[j * K + k];
+        for (int m = 0; m < count; m++) {
+          sum += out[nb[m] * K + k];
+        }
+        out[j * K + k] = sum * SSOR_OMEGA / A.diag(j);
+      }
+    }
+    for (int j = 0; j < n; j++) {
+      for (int k = 0; k < K; k++) {
+        out[j * K + k] *= A.diag(j) / SSOR_OMEGA;
+      }
+    }
+    for (int j = n - 1; j >= 0; j--) {
+      int count = upperNeighbors(j, nb);
+      for (int k = 0; k < K; k++) {
+        Real sum = out[j * K + k];
+        for (int m = 0; m < count; m++) {
+          sum += out[nb[m] * K + k];
+        }
+        out[j * K + k] = sum * SSOR_OMEGA / A.diag(j);
+      }
+    }
+    for (int j = 0; j < n * K; j++) {
+      out[j] *= (2.0 - SSOR_OMEGA) / SSOR_OMEGA;
+    }
+  }
+}
+
+template <class Real>
+size_t BasicPCG<Real>::memory() const
+{
+  return sizeof(Real) * (Lx.size() + r.size() + z.size() + p.size() + q.size()) +
+         sizeof(int) * (Lp.size() + Li.size());
+}
+
+/* Per right-hand side dot products of two vectors with K interleaved
+* right-hand sides, accumulated in double precision.  With a pool, each chunk
+* sums its part and the partial sums are added in chunk order, so the result
+* only depends on the number of chunks. */
+template <int K, class Real>
+static void dots(ThreadPool *pool, const Real *a, const Real *b, int n, double *out)
+{
+  int chunks = chunkCount(pool, n, VECTOR_GRAIN);
+  ::std::vector<double> partial(chunks * K);
+  runChunks(pool, chunks, [&](int c) {
+    double sum[K];
+    for (int k = 0; k < K; k++) {
+      sum[k] = 0.0;
+    }
+    for (int j = chunkBegin(n, chunks, c) * K; j < chunkBegin(n, chunks, c + 1) * K; j += K) {
+      for (int k = 0; k < K; k++) {
+        sum[k] += (double) a[j + k] * b[j + k];
+      }
+    }
+    for (int k = 0; k < K; k++) {
+      partial[c * K + k] = sum[k];
+    }
+  });
+  for (int k = 0; k < K; k++) {
+    out[k] = partial[k];
+    for (int c = 1; c < chunks; c++) {
+      out[k] += partial[c * K + k];
+    }
+  }
+}
+
+template <class Real>
+int BasicPCG<Real>::solve(gsl_vector *x, const gsl_vector *b, double tol, int max_iter, int *iter)
+{
+  switch (nrhs) {
+    case 1: return iterate<1>(x, b, tol, max_iter, iter);
+    case 2: return iterate<2>(x, b, tol, max_iter, iter);
+    case 3: return iterate<3>(x, b, tol, max_iter, iter);
+    default: return iterate<4>(x, b, tol, max_iter, iter);
+  }
+}
+
+/* The CG iteration for K right-hand sides; the per right-hand side scalars
+* live in small local arrays so that the vector loops unroll */
+template <class Real>
+template <int K>
+int BasicPCG<Real>::iterate(gsl_vector *xv, const gsl_vector *b, double tol, int max_iter, int *iter)
+{
+  int size = n * K;
+  ::std::vector<Real> x(size);
+  double bnorm[K], residual[K], rz[K], pq[K], rz_new[K];
+  Real alpha[K], beta[K];
+  for (int k = 0; k < K; k++) {
+    bnorm[k] = 0.0;
+  }
+  for (int j = 0; j < size; j++) {
+    x[j] = gsl_vector_get(xv, j);
+    bnorm[j % K] += gsl_vector_get(b, j) * gsl_vector_get(b, j);
+  }
+
+  /* r = b - Ax */
+  A.apply(&x[0], &r[0], K);
+  for (int j = 0; j < size; j++) {
+    r[j] = gsl_vector_get(b, j) - r[j];
+  }
+  ThreadPool *pool = A.threads();
+  dots<K, Real>(pool, &r[0], &r[0], n, residual);
+
+  /* Right-hand sides that have converged stop being updated (zero step) */
+  bool done[K];
+  int remaining = K;
+  for (int k = 0; k < K; k++) {
+    bnorm[k] = sqrt(bnorm[k]);
+    residual[k] = sqrt(residual[k]);
+    done[k] = residual[k] <= tol * bnorm[k];
+    if (done[k]) remaining--;
+    iter[k] = 0;
+    if (history) history[k].push_back(relative(residual[k], bnorm[k]));
+  }
+
+  if (remaining > 0) {
+    precondition(&r[0], &z[0]);
+    p = z;
+    dots<K, Real>(pool, &r[0], &z[0], n, rz);
+    for (int it = 1; it <= max_iter; it++) {
+      A.apply(&p[0], &q[0], K);
+      dots<K, Real>(pool, &p[0], &q[0], n, pq);
+      for (int k = 0; k < K; k++) {
+        alpha[k] = done[k] ? 0 : (Real) (rz[k] / pq[k]);
+      }
+      parallelFor(pool, n, VECTOR_GRAIN, [&](int begin, int end) {
+        for (int j = begin * K; j < end * K; j += K) {
+          for (int k = 0; k < K; k++) {
+            x[j + k] += alpha[k] * p[j + k];
+            r[j + k] -= alpha[k] * q[j + k];
+          }
+        }
+      });
+      dots<K, Real>(pool, &r[0], &r[0], n, residual);
+      for (int k = 0; k < K; k++) {
+        residual[k] = sqrt(residual[k]);
+        if (done[k]) continue;
+        iter[k] = it;
+        if (history) history[k].push_back(relative(residual[k], bnorm[k]));
+        if (residual[k] <= tol * bnorm[k]) {
+          done[k] = true;
+          remaining--;
+          /* only a solve long enough to have printed its progress says where it ended */
+          if (it >= 100) {
+            fprintf(stderr, "Channel %d converged after %d iterations, residual = %.12e\n", k, it, residual[k]);
+          }
+        }
+      }
+
+      /* print out residual norm ||A*x - b|| */
+      if (it % 100 == 0) {
+        fprintf(stderr, "iter %d residual =", it);
+        for (int k = 0; k < K; k++) {
+          fprintf(stderr, " %.12e", residual[k]);
+        }
+        fprintf(stderr, "\n");
+      }
+      if (remaining == 0) break;
+
+      precondition(&r[0], &z[0]);
+      dots<K, Real>(pool, &r[0], &z[0], n, rz_new);
+      for (int k = 0; k < K; k++) {
+        beta[k] = done[k] ? 0 : (Real) (rz_new[k] / rz[k]);
+        rz[k] = rz_new[k];
+      }
+      parallelFor(pool, n, VECTOR_GRAIN, [&](int begin, int end) {
+        for (int j = begin * K; j < end * K; j += K) {
+          for (int k = 0; k < K; k++) {
+            p[j + k] = z[j + k] + beta[k] * p[j + k];
+          }
+        }
+      });
+    }
+  }
+
+  for (int j = 0; j < size; j++) {
+    gsl_vector_set(xv, j, x[j]);
+  }
+
+  return (remaining == 0) ? GSL_SUCCESS : GSL_CONTINUE;
+}
+
+template <class Real>
+int BasicPCG<Real>::refine(gsl_vector *x, const gsl_vector *b, double tol, int max_iter, int *iter, int *steps)
+{
+  int K = nrhs;
+  int size = n * K;
+  ::std::vector<double> xd(size), ax(size);
+  gsl_vector *residual = gsl_vector_alloc(size);
+  gsl_vector *correction = gsl_vector_alloc(size);
+  double bnorm[PCG_MAX_RHS], rnorm[PCG_MAX_RHS];
+  int inner[PCG_MAX_RHS];
+  bool done[PCG_MAX_RHS];
+  for (int k = 0; k < K; k++) {
+    bnorm[k] = 0.0;
+    iter[k] = 0;
+    done[k] = false;
+  }
+  for (int j = 0; j < size; j++) {
+    bnorm[j % K] += gsl_vector_get(b, j) * gsl_vector_get(b, j);
+  }
+
+  int status = GSL_CONTINUE;
+  for (*steps = 0; ; (*steps)++) {
+    /* r = b - Ax in double precision; right-hand sides that have converged
+    *  get a zero residual, which the inner solver skips */
+    for (int j = 0; j < size; j++) {
+      xd[j] = gsl_vector_get(x, j);
+    }
+    A.apply(&xd[0], &ax[0], K);
+    for (int k = 0; k < K; k++) {
+      rnorm[k] = 0.0;
+    }
+    for (int j = 0; j < size; j++) {
+      double rj = gsl_vector_get(b, j) - ax[j];
+      gsl_vector_set(residual, j, rj);
+      rnorm[j % K] += rj * rj;
+    }
+    int remaining = K;
+    for (int k = 0; k < K; k++) {
+      if (history && !done[k]) history[k].push_back(relative(sqrt(rnorm[k]), sqrt(bnorm[k])));
+      if (sqrt(rnorm[k]) > tol * sqrt(bnorm[k])) continue;
+      done[k] = true;
+      remaining--;
+      for (int j = k; j < size; j += K) {
+        gsl_vector_set(residual, j, 0.0);
+      }
+    }
+    if (remaining == 0) {
+      status = GSL_SUCCESS;
+      break;
+    }
+    if (*steps == REFINE_MAX_STEPS) break;
+
+    /* x += A^-1 r, solved loosely; only the outer residuals are recorded */
+    gsl_vector_set_zero(correction);
+    ::std::vector<double> *outer = history;
+    history = NULL;
+    solve(correction, residual, REFINE_TOL, max_iter, inner);
+    history = outer;
+    for (int j = 0; j < size; j++) {
+      gsl_vector_set(x, j, gsl_vector_get(x, j) + gsl_vector_get(correction, j));
+    }
+    for (int k = 0; k < K; k++) {
+      iter[k] += inner[k];
+    }
+  }
+
+  gsl_vector_free(residual);
+  gsl_vector_free(correction);
+  return status;
+}
+
+template class BasicPCG<double>;
+template class BasicPCG<float>;
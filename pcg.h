@@ -0,0 +1,92 @@
+#ifndef PCG_H
+#define PCG_H
+/*
+pcg.h
+Preconditioned conjugate gradients for the Poisson system over Omega.
+The operator (Np on the diagonal, -1 between neighbors in Omega) is symmetric
+positive definite, so CG needs only a handful of vectors, unlike GMRES whose
+Krylov basis grows with every iteration of a restart cycle.
+*/
+
+#include <vector>
+#include <gsl/gsl_vector.h>
+
+#include "stencil.h"
+
+
+// Preconditioners selectable with --precond
+enum PrecondType {
+  PRECOND_JACOBI,   // inverse diagonal
+  PRECOND_IC0,      // incomplete Cholesky with the sparsity of A
+  PRECOND_SSOR      // symmetric successive over-relaxation
+};
+
+// Arithmetic of the CG iterations, selectable with --precision
+enum PrecisionType {
+  PRECISION_DOUBLE,  // everything in double precision
+  PRECISION_SINGLE,  // vectors, products and preconditioner in single precision
+  PRECISION_MIXED    // single precision corrections to double precision residuals
+};
+
+// Most right-hand sides a PCG solver can iterate at once
+static const int PCG_MAX_RHS = 4;
+
+// Conjugate gradient solver for the matrix-free Omega system, whose vectors,
+// products and preconditioner are of type Real (float or double).  Dot
+// products and norms are always accumulated in double precision
+template <class Real>
+class BasicPCG {
+public:
+  // Set up the preconditioner for A, which must outlive the solver, and work
+  // vectors for nrhs (at most PCG_MAX_RHS) simultaneous right-hand sides
+  BasicPCG(const Stencil &A, PrecondType type, int nrhs = 1);
+
+  // Solve Ax = b for every right-hand side to relative tolerance tol
+  // (||Ax - b|| <= tol * ||b||), starting from x, with at most max_iter
+  // iterations.  x and b interleave the right-hand sides (entry id * nrhs + k),
+  // and each one stops once it has converged.  Returns a GSL status code and
+  // the iterations taken by each right-hand side in iter.
+  int solve(gsl_vector *x, const gsl_vector *b, double tol, int max_iter, int *iter);
+
+  // Like solve, but by iterative refinement: the residual b - Ax is formed in
+  // double precision and each correction is solved by this solver to a loose
+  // tolerance, so that x reaches tol even if Real cannot.  iter is summed
+  // over the corrections, whose number is returned in steps
+  int refine(gsl_vector *x, const gsl_vector *b, double tol, int max_iter, int *iter, int *steps);
+
+  // Bytes held by the preconditioner and the CG work vectors
+  size_t memory() const;
+
+  // Have solve and refine append the relative residual ||Ax - b|| / ||b|| of
+  // each right-hand side k to history[k], once before the first iteration and
+  // once after each iteration until it converges (refine: once per
+  // correction).  NULL (the default) records nothing
+  void recordResiduals(::std::vector<double> *history_)
+    { history = history_; }
+
+private:
+  const Stencil &A;
+  PrecondType type;
+  int n;
+  int nrhs;
+  ::std::vector<double> *history;
+
+  // IC(0): lower triangular factor in compressed column format, with the
+  // diagonal entry first in each column
+  ::std::vector<int> Lp, Li;
+  ::std::vector<Real> Lx;
+
+  // CG work vectors, interleaved like x
+  ::std::vector<Real> r, z, p, q;
+
+  int lowerNeighbors(int j, int *nb) const;
+  int upperNeighbors(int j, int *nb) const;
+  void precondition(const Real *v, Real *out) const;
+  template <int K> int iterate(gsl_vector *x, const gsl_vector *b, double tol, int max_iter, int *iter);
+  void factor_ic0();
+};
+
+typedef BasicPCG<double> PCG;
+typedef BasicPCG<float> PCGSingle;
+
+#endif
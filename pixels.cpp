@@ -0,0 +1,332 @@
+/*
+pixels.cpp
+Per-pixel passes over whole 8-bit images.
+
+The SIMD versions reproduce the scalar arithmetic step for step: luminance and
+recoloring are computed in double precision with the same products and sums
+in the same order, then clamped and truncated, so that their bytes are
+identical.  They take 16 pixels (48 bytes) at a time and leave the rest to the
+scalar code.
+*/
+
+#include <cstdlib>
+#include <cstring>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXELS_X86
+#include <immintrin.h>
+#endif
+
+#include "pixels.h"
+
+/*******************************************************************************
+Scalar kernels, from pixel i on
+*******************************************************************************/
+
+static void whiteScalar(const unsigned char *rgb, uint64_t *bits, int i, int n)
+{
+  for (; i < n; i++) {
+    const unsigned char *p = rgb + 3 * i;
+    if (p[0] > 240 && p[1] > 240 && p[2] > 240) {
+      bits[i / 64] |= (uint64_t) 1 << (i % 64);
+    }
+  }
+}
+
+static void monochromeScalar(unsigned char *rgb, int i, int n)
+{
+  for (; i < n; i++) {
+    unsigned char *p = rgb + 3 * i;
+    double mono = 0.21*p[0] + 0.72*p[1] + 0.07*p[2];
+    if (mono > 255) {
+      mono = 255;
+    } else if (mono < 0){
+      mono = 0;
+    }
+    unsigned char m = (unsigned char) mono;
+    p[0] = p[1] = p[2] = m;
+  }
+}
+
+static void recolorScalar(unsigned char *rgb, int i, int n, const double scale[3])
+{
+  for (; i < n; i++) {
+    for (int c = 0; c < 3; c++) {
+      double value = rgb[3 * i + c] * scale[c];
+      if (value > 255) {
+        value = 255;
+      } else if (value < 0){
+        value = 0;
+      }
+      rgb[3 * i + c] = (unsigned char) value;
+    }
+  }
+}
+
+static void whiteAll(const unsigned char *rgb, uint64_t *bits, int n)
+  { whiteScalar(rgb, bits, 0, n); }
+static void monochromeAll(unsigned char *rgb, int n)
+  { monochromeScalar(rgb, 0, n); }
+static void recolorAll(unsigned char *rgb, int n, const double scale[3])
+  { recolorScalar(rgb, 0, n, scale); }
+
+#ifdef PIXELS_X86
+/*******************************************************************************
+SSE4.1 kernels
+*******************************************************************************/
+
+#define SSE41 __attribute__((target("sse4.1")))
+#define AVX2 __attribute__((target("avx2")))
+
+/* Split 16 interleaved pixels into one vector per channel */
+SSE41 static inline void splitRGB(const unsigned char *p, __m128i &r, __m128i &g, __m128i &b)
+{
+  __m128i v0 = _mm_loadu_si128((const __m128i *) p);
+  __m128i v1 = _mm_loadu_si128((const __m128i *) (p + 16));
+  __m128i v2 = _mm_loadu_si128((const __m128i *) (p + 32));
+  r = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(v0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(v1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+        _mm_shuffle_epi8(v2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+  g = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(v0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(v1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+        _mm_shuffle_epi8(v2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+  b = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(v0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(v1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+        _mm_shuffle_epi8(v2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+/* Store 16 gray values as 16 pixels with three equal channels */
+SSE41 static inline void storeGray(unsigned char *p, __m128i m)
+{
+  _mm_storeu_si128((__m128i *) p,
+    _mm_shuffle_epi8(m, _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5)));
+  _mm_storeu_si128((__m128i *) (p + 16),
+    _mm_shuffle_epi8(m, _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10)));
+  _mm_storeu_si128((__m128i *) (p + 32),
+    _mm_shuffle_epi8(m, _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15)));
+}
+
+/* Bytes 4k..4k+3 of v as 32-bit integers */
+SSE41 static inline __m128i widen(__m128i v, int k)
+{
+  switch (k) {
+    case 0: return _mm_cvtepu8_epi32(v);
+    case 1: return _mm_cvtepu8_epi32(_mm_srli_si128(v, 4));
+    case 2: return _mm_cvtepu8_epi32(_mm_srli_si128(v, 8));
+    default: return _mm_cvtepu8_epi32(_mm_srli_si128(v, 12));
+  }
+}
+
+/* Clamp two doubles to [0, 255] and truncate them to the low 32-bit lanes */
+SSE41 static inline __m128i truncate2(__m128d v)
+{
+  return _mm_cvttpd_epi32(_mm_max_pd(_mm_min_pd(v, _mm_set1_pd(255.0)), _mm_setzero_pd()));
+}
+
+/* 16 integers in [0, 255] as bytes */
+SSE41 static inline __m128i pack16(const __m128i q[4])
+{
+  return _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+}
+
+SSE41 static void whiteSSE41(const unsigned char *rgb, uint64_t *bits, int n)
+{
+  const __m128i limit = _mm_set1_epi8((char) 241);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i r, g, b;
+    splitRGB(rgb + 3 * i, r, g, b);
+    __m128i low = _mm_min_epu8(_mm_min_epu8(r, g), b);
+    uint64_t white = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(low, limit), low));
+    bits[i / 64] |= white << (i % 64);
+  }
+  whiteScalar(rgb, bits, i, n);
+}
+
+SSE41 static void monochromeSSE41(unsigned char *rgb, int n)
+{
+  const __m128d wr = _mm_set1_pd(0.21), wg = _mm_set1_pd(0.72), wb = _mm_set1_pd(0.07);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i r, g, b;
+    splitRGB(rgb + 3 * i, r, g, b);
+    __m128i q[4];
+    for (int k = 0; k < 4; k++) {
+      __m128i r4 = widen(r, k), g4 = widen(g, k), b4 = widen(b, k);
+      __m128i half[2];
+      for (int h = 0; h < 2; h++) {
+        __m128d mono = _mm_add_pd(_mm_add_pd(_mm_mul_pd(wr, _mm_cvtepi32_pd(r4)),
+                                             _mm_mul_pd(wg, _mm_cvtepi32_pd(g4))),
+                                  _mm_mul_pd(wb, _mm_cvtepi32_pd(b4)));
+        half[h] = truncate2(mono);
+        r4 = _mm_srli_si128(r4, 8);
+        g4 = _mm_srli_si128(g4, 8);
+        b4 = _mm_srli_si128(b4, 8);
+      }
+      q[k] = _mm_unpacklo_epi64(half[0], half[1]);
+    }
+    storeGray(rgb + 3 * i, pack16(q));
+  }
+  monochromeScalar(rgb, i, n);
+}
+
+SSE41 static void recolorSSE41(unsigned char *rgb, int n, const double scale[3])
+{
+  /* Pairs of bytes cycle through the channels with a period of three pairs */
+  const __m128d pattern[3] = {
+    _mm_setr_pd(scale[0], scale[1]),
+    _mm_setr_pd(scale[2], scale[0]),
+    _mm_setr_pd(scale[1], scale[2])
+  };
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    for (int k = 0; k < 3; k++) {
+      unsigned char *p = rgb + 3 * i + 16 * k;
+      __m128i v = _mm_loadu_si128((const __m128i *) p);
+      __m128i q[4];
+      for (int j = 0; j < 4; j++) {
+        __m128i v4 = widen(v, j);
+        int pair = 8 * k + 2 * j;
+        __m128i lo = truncate2(_mm_mul_pd(_mm_cvtepi32_pd(v4), pattern[pair % 3]));
+        __m128i hi = truncate2(_mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(v4, 8)), pattern[(pair + 1) % 3]));
+        q[j] = _mm_unpacklo_epi64(lo, hi);
+      }
+      _mm_storeu_si128((__m128i *) p, pack16(q));
+    }
+  }
+  recolorScalar(rgb, i, n, scale);
+}
+
+/*******************************************************************************
+AVX2 kernels
+*******************************************************************************/
+
+/* Clamp four doubles to [0, 255] and truncate them */
+AVX2 static inline __m128i truncate4(__m256d v)
+{
+  return _mm256_cvttpd_epi32(_mm256_max_pd(_mm256_min_pd(v, _mm256_set1_pd(255.0)), _mm256_setzero_pd()));
+}
+
+AVX2 static void whiteAVX2(const unsigned char *rgb, uint64_t *bits, int n)
+{
+  const __m256i limit = _mm256_set1_epi8((char) 241);
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    // Two runs of 16 pixels, one per 128-bit lane
+    __m128i r0, g0, b0, r1, g1, b1;
+    splitRGB(rgb + 3 * i, r0, g0, b0);
+    splitRGB(rgb + 3 * i + 48, r1, g1, b1);
+    __m256i r = _mm256_inserti128_si256(_mm256_castsi128_si256(r0), r1, 1);
+    __m256i g = _mm256_inserti128_si256(_mm256_castsi128_si256(g0), g1, 1);
+    __m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(b0), b1, 1);
+    __m256i low = _mm256_min_epu8(_mm256_min_epu8(r, g), b);
+    uint64_t white = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(low, limit), low));
+    bits[i / 64] |= white << (i % 64);
+  }
+  whiteScalar(rgb, bits, i, n);
+}
+
+AVX2 static void monochromeAVX2(unsigned char *rgb, int n)
+{
+  const __m256d wr = _mm256_set1_pd(0.21), wg = _mm256_set1_pd(0.72), wb = _mm256_set1_pd(0.07);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i r, g, b;
+    splitRGB(rgb + 3 * i, r, g, b);
+    __m128i q[4];
+    for (int k = 0; k < 4; k++) {
+      __m256d mono = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(wr, _mm256_cvtepi32_pd(widen(r, k))),
+                                                 _mm256_mul_pd(wg, _mm256_cvtepi32_pd(widen(g, k)))),
+                                   _mm256_mul_pd(wb, _mm256_cvtepi32_pd(widen(b, k))));
+      q[k] = truncate4(mono);
+    }
+    storeGray(rgb + 3 * i, pack16(q));
+  }
+  monochromeScalar(rgb, i, n);
+}
+
+AVX2 static void recolorAVX2(unsigned char *rgb, int n, const double scale[3])
+{
+  /* Runs of four bytes cycle through the channels with a period of three runs */
+  const __m256d pattern[3] = {
+    _mm256_setr_pd(scale[0], scale[1], scale[2], scale[0]),
+    _mm256_setr_pd(scale[1], scale[2], scale[0], scale[1]),
+    _mm256_setr_pd(scale[2], scale[0], scale[1], scale[2])
+  };
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    for (int k = 0; k < 3; k++) {
+      unsigned char *p = rgb + 3 * i + 16 * k;
+      __m128i v = _mm_loadu_si128((const __m128i *) p);
+      __m128i q[4];
+      for (int j = 0; j < 4; j++) {
+        q[j] = truncate4(_mm256_mul_pd(_mm256_cvtepi32_pd(widen(v, j)), pattern[(4 * k + j) % 3]));
+      }
+      _mm_storeu_si128((__m128i *) p, pack16(q));
+    }
+  }
+  recolorScalar(rgb, i, n, scale);
+}
+#endif
+
+/*******************************************************************************
+Dispatch
+*******************************************************************************/
+
+struct PixelKernelTable {
+  const char *name;
+  void (*white)(const unsigned char *, uint64_t *, int);
+  void (*monochrome)(unsigned char *, int);
+  void (*recolor)(unsigned char *, int, const double *);
+};
+
+/* The widest kernels the CPU runs, capped by POISSON_KERNELS */
+static PixelKernelTable selectKernels()
+{
+  PixelKernelTable table = { "scalar", whiteAll, monochromeAll, recolorAll };
+#ifdef PIXELS_X86
+  const char *cap = getenv("POISSON_KERNELS");
+  int level = 2;
+  if (cap && strcmp(cap, "scalar") == 0) {
+    level = 0;
+  } else if (cap && strcmp(cap, "sse4.1") == 0) {
+    level = 1;
+  }
+
+  __builtin_cpu_init();
+  if (level >= 1 && __builtin_cpu_supports("sse4.1")) {
+    PixelKernelTable sse41 = { "sse4.1", whiteSSE41, monochromeSSE41, recolorSSE41 };
+    table = sse41;
+  }
+  if (level >= 2 && __builtin_cpu_supports("avx2")) {
+    PixelKernelTable avx2 = { "avx2", whiteAVX2, monochromeAVX2, recolorAVX2 };
+    table = avx2;
+  }
+#endif
+  return table;
+}
+
+static const PixelKernelTable kernels = selectKernels();
+
+void whitePixels(const unsigned char *rgb, uint64_t *bits, int n)
+{
+  memset(bits, 0, ((n + 63) / 64) * sizeof(uint64_t));
+  kernels.white(rgb, bits, n);
+}
+
+void monochromePixels(unsigned char *rgb, int n)
+{
+  kernels.monochrome(rgb, n);
+}
+
+void recolorPixels(unsigned char *rgb, int n, const double scale[3])
+{
+  kernels.recolor(rgb, n, scale);
+}
+
+const char *pixelKernels()
+{
+  return kernels.name;
+}
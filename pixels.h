@@ -0,0 +1,48 @@
+#ifndef PIXELS_H
+#define PIXELS_H
+/*
+pixels.h
+Per-pixel passes over whole 8-bit images: finding the white pixels of a mask,
+and the monochrome and recolor conversions.  Each works on a run of
+interleaved RGB bytes, as stored by Im.  SSE4.1 and AVX2 versions are chosen
+at run time from what the CPU supports, and give exactly the bytes of the
+scalar version, which is used everywhere else.  The POISSON_KERNELS
+environment variable (scalar, sse4.1 or avx2) caps the choice.
+*/
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include "./lib/imageio++.h"
+
+
+/* Bit i % 64 of bits[i / 64] is set iff pixel i of the n pixels is whitish,
+*  that is, all its channels are above 240.  bits must hold (n + 63) / 64 words */
+void whitePixels(const unsigned char *rgb, uint64_t *bits, int n);
+
+/* Flag the whitish pixels among the n pixels of row y of im from column x,
+*  one bit each as set by whitePixels; bits grows to fit */
+inline void whiteRow(const Im &im, int x, int y, int n, ::std::vector<uint64_t> &bits)
+{
+  bits.resize(::std::max((n + 63) / 64, 1));
+  whitePixels(&im(x, y).r, &bits[0], n);
+}
+
+/* Returns true if bit i is set */
+inline bool bitSet(const ::std::vector<uint64_t> &bits, int i)
+{
+  return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+/* Replace each of n pixels by its luminance 0.21 R + 0.72 G + 0.07 B,
+*  truncated, in all three channels */
+void monochromePixels(unsigned char *rgb, int n);
+
+/* Scale channel c of each of n pixels by scale[c], clamped and truncated */
+void recolorPixels(unsigned char *rgb, int n, const double scale[3]);
+
+/* Instruction set the kernels run on: "avx2", "sse4.1" or "scalar" */
+const char *pixelKernels();
+
+#endif
@@ -0,0 +1,142 @@
+/*
+planar.cpp
+Float image with one plane per channel, for the Poisson solver.
+*/
+
+#include <stdint.h>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "planar.h"
+
+void bytesToPlanes(const unsigned char *rgb, float *r, float *g, float *b, int n)
+{
+  int i = 0;
+#if defined(__SSE2__)
+  /* Widen 16 pixels (48 bytes) to floats, then transpose each run of 4
+  *  pixels, held as r0 g0 b0 r1 | g1 b1 r2 g2 | b2 r3 g3 b3, into planes */
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 scale = _mm_set1_ps(255.0f);
+  for (; i + 16 <= n; i += 16) {
+    __m128 v[12];
+    for (int k = 0; k < 3; k++) {
+      __m128i bytes = _mm_loadu_si128((const __m128i *) (rgb + 3 * i + 16 * k));
+      __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+      __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+      v[4 * k] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), scale);
+      v[4 * k + 1] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), scale);
+      v[4 * k + 2] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), scale);
+      v[4 * k + 3] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), scale);
+    }
+    for (int k = 0; k < 4; k++) {
+      __m128 s0 = v[3 * k], s1 = v[3 * k + 1], s2 = v[3 * k + 2];
+      __m128 red = _mm_shuffle_ps(s0, _mm_shuffle_ps(s1, s2, _MM_SHUFFLE(1, 1, 2, 2)),
+                                  _MM_SHUFFLE(2, 0, 3, 0));
+      __m128 green = _mm_shuffle_ps(_mm_shuffle_ps(s0, s1, _MM_SHUFFLE(0, 0, 1, 1)),
+                                    _mm_shuffle_ps(s1, s2, _MM_SHUFFLE(2, 2, 3, 3)),
+                                    _MM_SHUFFLE(2, 0, 2, 0));
+      __m128 blue = _mm_shuffle_ps(_mm_shuffle_ps(s0, s1, _MM_SHUFFLE(1, 1, 2, 2)),
+                                   _mm_shuffle_ps(s2, s2, _MM_SHUFFLE(3, 3, 0, 0)),
+                                   _MM_SHUFFLE(2, 0, 2, 0));
+      _mm_storeu_ps(r + i + 4 * k, red);
+      _mm_storeu_ps(g + i + 4 * k, green);
+      _mm_storeu_ps(b + i + 4 * k, blue);
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    r[i] = rgb[3 * i] / 255.0f;
+    g[i] = rgb[3 * i + 1] / 255.0f;
+    b[i] = rgb[3 * i + 2] / 255.0f;
+  }
+}
+
+void planesToBytes(const float *r, const float *g, const float *b, unsigned char *rgb, int n)
+{
+  int i = 0;
+#if defined(__SSE2__)
+  /* The reverse: scale and clamp 4 pixels per plane, interleave them, and
+  *  truncate and pack 16 pixels at a time */
+  const __m128 scale = _mm_set1_ps(255.0f);
+  const __m128 zero = _mm_setzero_ps();
+  for (; i + 16 <= n; i += 16) {
+    __m128i q[12];
+    for (int k = 0; k < 4; k++) {
+      __m128 red = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(r + i + 4 * k), scale), zero), scale);
+      __m128 green = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(g + i + 4 * k), scale), zero), scale);
+      __m128 blue = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(b + i + 4 * k), scale), zero), scale);
+      __m128 s0 = _mm_shuffle_ps(_mm_shuffle_ps(red, green, _MM_SHUFFLE(0, 0, 0, 0)),
+                                 _mm_shuffle_ps(blue, red, _MM_SHUFFLE(1, 1, 0, 0)),
+                                 _MM_SHUFFLE(2, 0, 2, 0));
+      __m128 s1 = _mm_shuffle_ps(_mm_shuffle_ps(green, blue, _MM_SHUFFLE(1, 1, 1, 1)),
+                                 _mm_shuffle_ps(red, green, _MM_SHUFFLE(2, 2, 2, 2)),
+                                 _MM_SHUFFLE(2, 0, 2, 0));
+      __m128 s2 = _mm_shuffle_ps(_mm_shuffle_ps(blue, red, _MM_SHUFFLE(3, 3, 2, 2)),
+                                 _mm_shuffle_ps(green, blue, _MM_SHUFFLE(3, 3, 3, 3)),
+                                 _MM_SHUFFLE(2, 0, 2, 0));
+      q[3 * k] = _mm_cvttps_epi32(s0);
+      q[3 * k + 1] = _mm_cvttps_epi32(s1);
+      q[3 * k + 2] = _mm_cvttps_epi32(s2);
+    }
+    for (int k = 0; k < 3; k++) {
+      __m128i lo = _mm_packs_epi32(q[4 * k], q[4 * k + 1]);
+      __m128i hi = _mm_packs_epi32(q[4 * k + 2], q[4 * k + 3]);
+      _mm_storeu_si128((__m128i *) (rgb + 3 * i + 16 * k), _mm_packus_epi16(lo, hi));
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    rgb[3 * i] = floatToByte(r[i]);
+    rgb[3 * i + 1] = floatToByte(g[i]);
+    rgb[3 * i + 2] = floatToByte(b[i]);
+  }
+}
+
+PlanarIm::PlanarIm() : width(0), height(0), pitch(0), planes(NULL)
+{}
+
+PlanarIm::PlanarIm(int width_, int height_)
+{
+  allocate(width_, height_);
+}
+
+PlanarIm::PlanarIm(const Im &im, int left, int top, int width_, int height_)
+{
+  allocate(width_, height_);
+  if (width == 0) return;
+  for (int y = 0; y < height; y++) {
+    bytesToPlanes(&im(left, top + y).r, row(0, y), row(1, y), row(2, y), width);
+  }
+}
+
+PlanarIm::PlanarIm(const PlanarIm &im, int left, int top, int width_, int height_)
+{
+  allocate(width_, height_);
+  for (int c = 0; c < 3; c++) {
+    for (int y = 0; y < height; y++) {
+      ::std::copy(im.row(c, top + y) + left, im.row(c, top + y) + left + width, row(c, y));
+    }
+  }
+}
+
+void PlanarIm::allocate(int width_, int height_)
+{
+  width = width_;
+  height = height_;
+
+  /* Rows padded to 8 floats, plus slack to align the first one */
+  pitch = (width + 7) & ~7;
+  storage.assign(3 * (size_t) height * pitch + 8, 0.0f);
+  uintptr_t address = (uintptr_t) &storage[0];
+  planes = &storage[0] + ((32 - address % 32) % 32) / sizeof(float);
+}
+
+void PlanarIm::toIm(Im &im, int left, int top) const
+{
+  if (width == 0) return;
+  for (int y = 0; y < height; y++) {
+    planesToBytes(row(0, y), row(1, y), row(2, y), &im(left, top + y).r, width);
+  }
+}
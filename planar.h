@@ -0,0 +1,79 @@
+#ifndef PLANAR_H
+#define PLANAR_H
+/*
+planar.h
+Float image with one plane per channel, for the Poisson solver.  Values are in
+[0, 1], as in the solution vector, and each row of each plane starts on a
+32-byte boundary, so that per-channel loops over a row are contiguous and
+aligned.  An image is converted from 8-bit Im once when it is read and back
+once when it is written; in between, everything works on the planes.
+*/
+
+#include <vector>
+
+#include "./lib/imageio++.h"
+
+
+class PlanarIm {
+public:
+  // Constructors: empty, all zero, or the width x height window of im whose
+  // top left corner is (left, top), which must lie inside im
+  PlanarIm();
+  PlanarIm(int width, int height);
+  PlanarIm(const Im &im, int left, int top, int width, int height);
+  PlanarIm(const PlanarIm &im, int left, int top, int width, int height);
+
+  // Accessors for width and height, and the number of floats from one row of
+  // a plane to the next
+  int w() const
+    { return width; }
+  int h() const
+    { return height; }
+  int stride() const
+    { return pitch; }
+
+  // Row y of channel c.  *No* bounds checking.
+  const float *row(int c, int y) const
+    { return planes + ((size_t) c * height + y) * pitch; }
+  float *row(int c, int y)
+    { return planes + ((size_t) c * height + y) * pitch; }
+
+  // Access by (x, y) coordinate and channel.  *No* bounds checking.
+  const float &operator () (int x, int y, int c) const
+    { return row(c, y)[x]; }
+  float &operator () (int x, int y, int c)
+    { return row(c, y)[x]; }
+
+  // Write the image into the window of im at (left, top), scaled to 0-255,
+  // clamped and truncated
+  void toIm(Im &im, int left, int top) const;
+
+private:
+  int width, height, pitch;
+  ::std::vector<float> storage;
+  float *planes;  // aligned start of the planes within storage
+
+  void allocate(int width, int height);
+
+  PlanarIm(const PlanarIm &);
+  PlanarIm &operator=(const PlanarIm &);
+};
+
+/* A channel value in [0, 1] as a byte, clamped and truncated, as written out */
+inline unsigned char floatToByte(float v)
+{
+  v *= 255.0f;
+  if (v > 255.0f) {
+    v = 255.0f;
+  } else if (v < 0.0f) {
+    v = 0.0f;
+  }
+  return (unsigned char) v;
+}
+
+/* Split n interleaved RGB bytes into three planes of floats in [0, 1], and
+*  back with clamping and truncation, with SSE2 where the build allows */
+void bytesToPlanes(const unsigned char *rgb, float *r, float *g, float *b, int n);
+void planesToBytes(const float *r, const float *g, const float *b, unsigned char *rgb, int n);
+
+#endif
@@ -11,474 +11,1121 @@ in Perez et al. in 2003
 #include <string>
 #include <cstdio>
 #include <cstdlib>
-#include <gsl/gsl_vector.h>
-#include <gsl/gsl_spmatrix.h>
-#include <gsl/gsl_splinalg.h>
+#include <cstring>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <future>
+#include <algorithm>
+#include <unordered_map>
+#include <gsl/gsl_errno.h>
 
 #include "./lib/imageio++.h"
+#include "clone.h"
+#include "imagecache.h"
+#include "jobqueue.h"
+#include "pixels.h"
+#include "timing.h"
 
 /*******************************************************************************
 Helper functions
 *******************************************************************************/
 
-/* Returns true if pixel is whitish */
-inline bool isWhite(Color &pixel)
+/* Recolors an image (deep copy) by scaling RGB values by scaleR, scaleG, and scaleB */
+/* Returns recolored image */
+inline Im imRecolor(Im im, double scaleR, double scaleG, double scaleB)
 {
-  if (pixel.r > 240 && pixel.g > 240 && pixel.b > 240) {
-    return true;
+  double scale[3] = { scaleR, scaleG, scaleB };
+  if (im.w() > 0 && im.h() > 0) {
+    recolorPixels(&im[0].r, im.w() * im.h(), scale);
   }
 
-  return false;
+  return im;
 }
 
-/* Return a [N, E, S, W] array of int arrays containg a pair of values:
-* The first index denotes the "status" of the pixel q in the corresponding
-* cardinal direction to p, and the second index will be q's index (potentially
-* out of bounds). The status type are as follows:
-*    1 -> in Omega
-*    0 -> in boundary of Omega
-*   -1 -> not in image
-*
-* NB: p must be valid, as there is no boundary checking
-*/
-inline std::vector< std::vector<int> > getNeighbors(int p, int w, int h, ::std::vector<int> &toOmega)
+/* Converts an image to monochrome using luminosity (does not overwrite im) */
+inline Im imToMonochrome(Im im)
 {
-  std::vector< std::vector<int> > results (4, std::vector<int>(3, 0));
-  int q;
-
-  // North
-  q = p - w;
-  results[0][1] = q;
-  if (q >= 0) {
-    if (toOmega[q] != -1) {
-      // q is in Omega
-      results[0][0] = 1;
-    } else {
-      // q is in boundary of Omega
-      results[0][0] = 0;
-    }
-  } else {
-    // q is outside image
-    results[0][0] = -1;
+  if (im.w() > 0 && im.h() > 0) {
+    monochromePixels(&im[0].r, im.w() * im.h());
   }
 
-  // East
-  q = p + 1;
-  results[1][1] = q;
-  if ((q % w) != 0) {
-    if (toOmega[q] != -1) {
-      // q is in Omega
-      results[1][0] = 1;
-    } else {
-      // q is in boundary of Omega
-      results[1][0] = 0;
+  return im;
+}
+
+/*******************************************************************************
+Poisson Seamless Cloning
+*******************************************************************************/
+
+/* Where the time and memory of a clone operation went, for --stats */
+struct RunStats {
+  // A phase of the operation: its wall time, and the peak memory of the
+  // process once it ended
+  struct Phase {
+    ::std::string name;
+    double seconds;
+    long peakKB;
+  };
+  ::std::vector<Phase> phases;  // in the order they ran
+
+  // The Poisson solve, if any: the unknowns of Omega and of each component,
+  // and what each component took
+  int unknowns;
+  ::std::vector<int> sizes;
+  CloneReport report;
+
+  RunStats() : unknowns(0)
+    {}
+
+  // Record a phase that ended when the peak memory was peakKB, or just now
+  void add(const char *name, double seconds, long peakKB)
+  {
+    Phase phase = { name, seconds, peakKB };
+    phases.push_back(phase);
+  }
+  void add(const char *name, double seconds)
+    { add(name, seconds, peakRSS()); }
+};
+
+// Implements poisson seamless cloning, into dest.  If set, stats gets the
+// phases of the solve and what each component took
+inline int poisson_clone(const Im &src, const Im &mask, Im &dest, int xOff, int yOff,
+                        CloneMode mode, double param1, double param2,
+                        const SolverOptions &opts, bool verbose, RunStats *stats)
+{
+  if (verbose) printf("Poisson cloning...\n");
+  double start = wallTime();
+
+  /* Everything that depends on the mask alone: the index maps of Omega, its
+  *  stencil and components, and dest as float planes */
+  CloneSession session (dest, mask, opts);
+  double setup = wallTime() - start;
+  long setupKB = peakRSS();
+  if (verbose) {
+    printf("Mapped Omega in a %dx%d frame in %.3f s\n", session.frameWidth(), session.frameHeight(), setup);
+    if (session.threads()) {
+      printf("Using %d threads\n", session.threads()->size());
     }
-  } else {
-    // q is outside image
-    results[1][0] = -1;
   }
 
-  // South
-  q = p + w;
-  results[2][1] = q;
-  if (((int) q / w) < h) {
-    if (toOmega[q] != -1) {
-      // q is in Omega
-      results[2][0] = 1;
-    } else {
-      // q is in boundary of Omega
-      results[2][0] = 0;
+  int status = session.clone(src, xOff, yOff, mode, param1, param2, dest);
+  if (status != GSL_SUCCESS) {
+    fprintf(stderr, "Warning: not every channel converged\n");
+  }
+  if (stats) {
+    /* Converting dest when the session was made counts toward assembly; the
+    *  matrix is assembled or factored within the solve of its component */
+    const CloneReport &report = session.report();
+    double matrix = 0.0;
+    for (size_t k = 0; k < report.components.size(); k++) {
+      matrix += report.components[k].matrix;
+      stats->sizes.push_back(session.parts()[k].size());
     }
-  } else {
-    // q is outside image
-    results[2][0] = -1;
+    stats->unknowns = session.size();
+    stats->report = report;
+    stats->add("index", report.indexing, report.indexingKB);
+    stats->add("assembly", setup - report.indexing + report.assembly, ::std::max(setupKB, report.assemblyKB));
+    stats->add("matrix", matrix, report.solveKB);
+    stats->add("solve", ::std::max(report.solve - matrix, 0.0), report.solveKB);
+    if (report.compared) stats->add("compare", report.compareSeconds, report.writebackKB);
+    stats->add("writeback", report.writeback, report.writebackKB);
   }
-
-  // West
-  q = p - 1;
-  results[3][1] = q;
-  if ((p % w) != 0) {
-    if (toOmega[q] != -1) {
-      // q is in Omega
-      results[3][0] = 1;
-    } else {
-      // q is in boundary of Omega
-      results[3][0] = 0;
+  if (verbose) {
+    const CloneReport &report = session.report();
+    const ::std::vector<Component> &components = session.parts();
+    printf("Assembled system of %d unknowns in %.3f s\n", session.size(), report.assembly);
+    printf("Omega has %zu connected components\n", components.size());
+    printf("Solved all channels in %.3f s\n", report.solve);
+
+    /* Report per component, in label order */
+    for (size_t k = 0; k < components.size(); k++) {
+      const Component &comp = components[k];
+      const ComponentResult &res = report.components[k];
+      printf("Component %zu: %d unknowns in %dx%d at (%d, %d), %s, %.3f s",
+             k, comp.size(), comp.width, comp.height, session.frameLeft() + comp.left,
+             session.frameTop() + comp.top, solverName(res.solver), res.seconds);
+      if (res.solver == SOLVER_MG || res.solver == SOLVER_FMG) {
+        printf(", %d levels, iterations %d %d %d", res.levels, res.iter[0], res.iter[1], res.iter[2]);
+      } else if (res.solver == SOLVER_PCG) {
+        printf(", %zu KB, iterations %d %d %d", res.memory / 1024, res.iter[0], res.iter[1], res.iter[2]);
+        if (opts.precision == PRECISION_SINGLE) {
+          printf(", single precision");
+        } else if (opts.precision == PRECISION_MIXED) {
+          printf(", mixed precision with %d refinement steps", res.steps);
+        }
+      } else if (res.solver == SOLVER_GMRES) {
+        printf(", matrix assembled in %.3f s", res.matrix);
+      } else if (res.solver == SOLVER_CHOLESKY && res.cached) {
+        printf(", %zu KB factor mapped from cache", res.memory / 1024);
+      } else if (res.solver == SOLVER_CHOLESKY) {
+        printf(", %zu KB factor computed in %.3f s", res.memory / 1024, res.matrix);
+      }
+      printf("\n");
     }
-  } else {
-    // q is outside image
-    results[3][0] = -1;
+    if (opts.solver == SOLVER_FFT) {
+      int fallbacks = 0;
+      for (size_t k = 0; k < report.components.size(); k++) {
+        if (report.components[k].solver != SOLVER_FFT) fallbacks++;
+      }
+      if (fallbacks) printf("%d components are not rectangles and fell back to GMRES\n", fallbacks);
+    }
+    if (opts.solver == SOLVER_CHOLESKY) {
+      int fallbacks = 0;
+      for (size_t k = 0; k < report.components.size(); k++) {
+        if (report.components[k].solver != SOLVER_CHOLESKY) fallbacks++;
+      }
+      if (fallbacks) printf("%d components do not border dest and fell back to PCG\n", fallbacks);
+    }
+    if (report.compared) {
+      printf("Double precision solve took %.3f s; max pixel difference %d, in %d of %d channel values\n",
+             report.compareSeconds, report.maxDiff, report.differing, 3 * session.size());
+    }
+
+    printf("Peak memory: %ld KB\n", peakRSS());
   }
 
-  return results;
+  return 0;
 }
 
-/* Returns the guidance v between p and q
-* Rmk: computed as g(p) - g(q)
-* NB: Does not check boundaries
-*/
-inline double guidance(Im &src, Im &dest, int p, int q, int xOff, int yOff, int channel,
-                      int mode, double param1, double param2, double param3)
+/*******************************************************************************
+Direct Cloning
+*******************************************************************************/
+
+// Implements direct [seamed] cloning, into dest
+inline int direct_clone(const Im &src, const Im &mask, Im &dest, int xOff, int yOff, bool verbose)
 {
-  // Take into account offsets; set gradient to 0 if either pixel goes outside!
-  int W = src.w();
-  int H = src.h();
-  int destW = dest.w();
-
-  // Coords in Dest
-  int px = p % destW;
-  int py = p / destW;
-  int qx = q % destW;
-  int qy = q / destW;
-
-  // Coords in src
-  int pu = px - xOff;
-  int pv = py - yOff;
-  int qu = qx - xOff;
-  int qv = qy - yOff;
-
-  // Check boundaries
-  if (pu < 0 || pv < 0 || qu < 0 || qv < 0 || pu >= W || qu >= W || pv >= H || qv >= H) {
-    return 0;
-  }
+  // Number of pixels in dest and mask
+  int W = dest.w();
+  int H = dest.h();
 
-  if (mode == 1) {
-    // mixed mode
-    double gradg = (((double) src(pu, pv)[channel]) - ((double) src(qu, qv)[channel])) / 255.0;
-    double gradf = (((double) dest[p][channel]) - ((double) dest[q][channel])) / 255.0;
-    if (abs(gradf) > abs(gradg)) {
-      return gradf;
-    } else {
-      return gradg;
-    }
-  } else if (mode == 2) {
-    // flat mode (lazy way... threshol :P)
-    double gradg = ((double) src(pu, pv)[channel]) - ((double) src(qu, qv)[channel]);
-    if (abs(gradg) > param1) {
-      return (gradg * param2 / 255.0);
-    } else {
-      return 0;
-    }
-  } else if (mode == 3) {
-    // illumination mode
-    double gradg = (((double) src(pu, pv)[channel]) - ((double) src(qu, qv)[channel])) / 255.0;
-    if (gradg == 0) {
-      // avoid NaN
-      return 0;
-    }
-    return (pow(param1, param2) * pow(abs(1.0), -1.0 * param2) * gradg);
-  } else if (mode == 4) {
-    // texture mode (not perfect -> leads to discoloration and only adds more grain)
-    double gradg = (((double) src(pu, pv)[channel]) - ((double) src(qu, qv)[channel]));
-    double gradf = (((double) dest[p][channel]) - ((double) dest[q][channel]));
-    if (abs(gradf) < param1) {
-      return ((gradf + gradg) / 255.0);
-    } else {
-      return (gradg / 255.0);
+  int srcW = src.w();
+  int srcH = src.h();
+
+  if (verbose) printf("Direct cloning...\n");
+
+  /* Clone masked region from src to dest, over the part of dest that src
+  *  covers, a row of mask flags at a time */
+  int xa = ::std::max(xOff, 0);
+  int xb = ::std::min(W, srcW + xOff);
+  int n = xb - xa;
+  ::std::vector<uint64_t> white;
+  for (int y = ::std::max(yOff, 0); n > 0 && y < ::std::min(H, srcH + yOff); y++) {
+    whiteRow(mask, xa, y, n, white);
+
+    // Copy each run of white pixels at once, skipping empty words
+    for (int i = 0; i < n; ) {
+      if (i % 64 == 0 && !white[i / 64]) {
+        i += 64;
+      } else if (!bitSet(white, i)) {
+        i++;
+      } else {
+        int end = i;
+        while (end < n && bitSet(white, end)) end++;
+        memcpy(&dest(xa + i, y), &src(xa + i - xOff, y - yOff), (end - i) * sizeof(Color));
+        i = end;
+      }
     }
-  } else {
-    // default (mode == 0 presumably)
-    return (((double) src(pu, pv)[channel]) - ((double) src(qu, qv)[channel])) / 255.0;
   }
+
+  return 0;
 }
 
-/* Set channel of pixel p in dest to value v in range [0-1] */
-inline void setPixel(Im &dest, int p, double v, int channel) {
-  // Scale and Clamp
-  v *= 255.0;
-  if (v > 255) {
-    v = 255;
-  } else if (v < 0){
-    v = 0;
-  }
+/*******************************************************************************
+Jobs
+*******************************************************************************/
 
-  dest[p][channel] = (unsigned char) v;
-  return;
+/* Read the image at path, through cache if set; NULL if it cannot be read */
+inline ::std::shared_ptr<const Im> readImage(const char *path, ImageCache *cache)
+{
+  if (cache) return cache->get(path);
+  ::std::shared_ptr<Im> im (new Im);
+  if (!im->read(path)) return ::std::shared_ptr<const Im>();
+  return im;
 }
 
-/* Get value of source pixel cooresponding to p in dest*/
-inline double sourcePixel(Im &src, int W, int p, int xOff, int yOff, int channel)
+/* Read only the rows of the mask at path that hold Omega or its boundary, at
+*  full width, into band, which starts at row top of the mask.  The file is
+*  decoded twice: once to find the rows, once to keep them.  An empty mask
+*  gives an empty band.  Returns false if the mask cannot be read */
+inline bool readMaskBand(const char *path, Im &band, int &top, int &width, int &height)
 {
-  // Coords in Dest
-  int px = p % W;
-  int py = p / W;
-
-  // Coords in src
-  int pu = px - xOff;
-  int pv = py - yOff;
+  ImReader in;
+  if (!in.open(path)) return false;
+  width = in.w();
+  height = in.h();
+  Im row (width, 1);
+  ::std::vector<uint64_t> white;
+  int y0 = height, y1 = -1, y = 0;
+  for (; in.readRow(&row[0]); y++) {
+    whiteRow(row, 0, 0, width, white);
+    for (size_t k = 0; k < white.size(); k++) {
+      if (white[k]) {
+        y0 = ::std::min(y0, y);
+        y1 = y;
+        break;
+      }
+    }
+  }
+  in.close();
+  if (y < height) return false;
+
+  top = 0;
+  band = Im(width, 0);
+  if (y1 < 0) return true;
+  top = ::std::max(y0 - 1, 0);
+  int bottom = ::std::min(y1 + 1, height - 1);
+  band = Im(width, bottom - top + 1);
+  if (!in.open(path)) return false;
+  for (int y = 0; y <= bottom; y++) {
+    if (!in.readRow(y < top ? &row[0] : &band(0, y - top))) return false;
+  }
+  return true;
+}
 
-  // Check boundaries
-  if (pu < 0 || pv < 0 || pu >= src.w() || pv >= src.h()) {
-    return 0;
-  } else {
-    return (src(pu, pv)[channel] / 255.0);
+/* Copy the next n rows of in to out, converted to monochrome if decolor, or
+*  skip them if out is NULL.  Returns false if either file ends first */
+inline bool copyRows(ImReader &in, ImWriter *out, int n, bool decolor)
+{
+  Im row (in.w(), 1);
+  for (int i = 0; i < n; i++) {
+    if (!in.readRow(&row[0])) return false;
+    if (decolor) monochromePixels(&row[0].r, row.w());
+    if (out && !out->writeRow(&row[0])) return false;
   }
+  return true;
 }
 
-/* Solve a sparse linear system of equations of form Ax = b.
-* Code sourced from docs: https://www.gnu.org/software/gsl/doc/html/splinalg.html
-*/
-inline int solve(gsl_spmatrix *A, gsl_vector *x, gsl_vector *b, int OMEGA_SIZE)
+/* Name of the sidecar that places the patch at path in its dest */
+inline ::std::string patchSidecar(const char *path)
 {
-  const double tol = 1.0e-6;  /* solution relative tolerance */
-  const size_t max_iter = 1000; /* maximum iterations */
-  const gsl_splinalg_itersolve_type *T = gsl_splinalg_itersolve_gmres;
-  gsl_splinalg_itersolve *work = gsl_splinalg_itersolve_alloc(T, OMEGA_SIZE, 0);
-  size_t iter = 0;
-  double residual;
-  int status;
-
-  /* solve the system Ax = b */
-  do {
-    status = gsl_splinalg_itersolve_iterate(A, b, tol, x, work);
-
-    /* print out residual norm ||A*x - b|| */
-    if (iter % 100 == 0) {
-      residual = gsl_splinalg_itersolve_normr(work);
-      fprintf(stderr, "iter %zu residual = %.12e\n", iter, residual);
-    }
-
-    if (status == GSL_SUCCESS)
-    fprintf(stderr, "Converged\n");
-  } while (status == GSL_CONTINUE && ++iter < max_iter);
-
-  gsl_splinalg_itersolve_free(work);
-  return status;
+  return ::std::string(path) + ".patch";
 }
 
-/* Recolors an image (deep copy) by scaling RGB values by scaleR, scaleG, and scaleB */
-/* Returns recolored image */
-inline Im imRecolor(Im im, double scaleR, double scaleG, double scaleB)
+/* Name to write out under until it is complete, beside it and with the same
+*  extension so that the encoder is the same: out may be the file dest is read
+*  from, and is left alone if writing fails */
+inline ::std::string temporaryBeside(const char *outfilename)
 {
-  for (int y = im.h() - 1; y >= 0; y--) {
-    for (int x = im.w() - 1; x >= 0; x--) {
-      for (int c = 0; c < 3; c++) {
-        // Compute recolored value
-        Color &pixel = im(x, y);
-        double value = pixel[c];
-        if (c == 0)
-          value *= scaleR;
-        else if (c == 1)
-          value *= scaleG;
-        else
-          value *= scaleB;
-
-        // Clamp
-        if (value > 255) {
-          value = 255;
-        } else if (value < 0){
-          value = 0;
-        }
+  ::std::string temporary = ::std::string(outfilename) + ".tmp";
+  const char *ext = strrchr(outfilename, '.');
+  if (ext) temporary += ext;
+  return temporary;
+}
 
-        // Cast and set
-        unsigned char p = (unsigned char) value;
-        pixel[c] = p;
-      }
-    }
+/* Write only the frame of Omega, from the rows of dest starting at row top of
+*  a W x H dest, to path, and its place in dest to the sidecar of path, as the
+*  line "left top width height W H".  Returns false if either cannot be written */
+inline bool writePatch(const Im &dest, const Im &mask, int top, int W, int H, const char *path, ImEncode encode)
+{
+  int left, ftop, width, height;
+  if (!maskFrame(mask, left, ftop, width, height)) {
+    fprintf(stderr, "Error: the mask is empty, so there is no patch to write\n");
+    return false;
+  }
+  Im patch (width, height);
+  for (int y = 0; y < height; y++) {
+    memcpy(&patch(0, y), &dest(left, ftop + y), width * sizeof(Color));
   }
+  if (!patch.write(path, encode)) return false;
 
-  return im;
+  ::std::string sidecar = patchSidecar(path);
+  FILE *file = fopen(sidecar.c_str(), "w");
+  if (file == NULL) {
+    fprintf(stderr, "Error: cannot write %s\n", sidecar.c_str());
+    return false;
+  }
+  fprintf(file, "%d %d %d %d %d %d\n", left, top + ftop, width, height, W, H);
+  return fclose(file) == 0;
 }
 
-/* Converts an image to monochrome using luminosity (does not overwrite im) */
-inline Im imToMonochrome(Im im)
+/* Apply a patch written with --patch to dest, and write the result to out,
+*  which may be dest itself.  dest goes to out a row at a time, so only the
+*  patch is held whole.  Returns 0 on success */
+inline int runApply(const char *patchfilename, const char *destfilename, const char *outfilename,
+                    ImEncode encode)
 {
-  for (int y = im.h() - 1; y >= 0; y--) {
-    for (int x = im.w() - 1; x >= 0; x--) {
-      // Compute luminance value and clamp
-      Color &pixel = im(x, y);
-      double mono = 0.21*pixel[0] + 0.72*pixel[1] + 0.07*pixel[2];
-      if (mono > 255) {
-        mono = 255;
-      } else if (mono < 0){
-        mono = 0;
-      }
-      // Cast and set
-      unsigned char m = (unsigned char) mono;
-      for (int j = 0; j < 3; j++)
-        pixel[j] = m;
-    }
+  ::std::string sidecar = patchSidecar(patchfilename);
+  FILE *file = fopen(sidecar.c_str(), "r");
+  int left, top, width, height, W, H;
+  if (file == NULL || fscanf(file, "%d %d %d %d %d %d", &left, &top, &width, &height, &W, &H) != 6) {
+    fprintf(stderr, "Error: cannot read the placement of %s from %s\n", patchfilename, sidecar.c_str());
+    if (file) fclose(file);
+    return 1;
+  }
+  fclose(file);
+
+  Im patch;
+  if (!patch.read(patchfilename)) return 1;
+  ImReader destIn;
+  if (!destIn.open(destfilename)) return 1;
+  /* The sidecar is trusted no further than dest: the patch must lie within it */
+  if (patch.w() != width || patch.h() != height || destIn.w() != W || destIn.h() != H ||
+      left < 0 || top < 0 || width < 0 || height < 0 || left > W - width || top > H - height) {
+    fprintf(stderr, "Error: %s is not a %d x %d patch at (%d, %d) of a %d x %d dest\n", patchfilename,
+            width, height, left, top, destIn.w(), destIn.h());
+    return 1;
   }
 
-  return im;
+  /* Write beside out and rename, so that out can be dest */
+  ::std::string temporary = temporaryBeside(outfilename);
+  ImWriter outFile;
+  if (!outFile.open(temporary, W, H, encode)) return 1;
+  bool written = copyRows(destIn, &outFile, top, false);
+  Im row (W, 1);
+  for (int y = 0; written && y < height; y++) {
+    written = destIn.readRow(&row[0]);
+    memcpy(&row(left, 0), &patch(0, y), width * sizeof(Color));
+    written = written && outFile.writeRow(&row[0]);
+  }
+  written = written && copyRows(destIn, &outFile, H - top - height, false);
+  written = outFile.close() && written;
+  destIn.close();
+  if (!written || rename(temporary.c_str(), outfilename) != 0) {
+    fprintf(stderr, "Error: applying %s failed\n", patchfilename);
+    remove(temporary.c_str());
+    return 1;
+  }
+  return 0;
 }
 
-/*******************************************************************************
-Poisson Seamless Cloning
-*******************************************************************************/
+/* How a job reads its dest and writes its output */
+struct JobOptions {
+  bool stream;      // hold only the rows of dest that the mask touches
+  bool patch;       // write only the frame of Omega, and where it goes
+  ImEncode encode;  // encoder profile of out
+  ::std::string shared;  // directory of decoded images shared between runs, none if empty
+  ::std::string stats;   // file the phases and solver histories of each job go to, as JSON; none if empty
+
+  JobOptions() : stream(false), patch(false), encode(IM_ENCODE_DEFAULT)
+    {}
+};
+
+/* A clone operation as it moves from decoding, through cloning, to encoding */
+struct Job {
+  ::std::vector< ::std::string> args;  // as on the command line, program name first
+  int line;                            // in the manifest
+  int index;                           // among the jobs of the manifest
+
+  // The decoded images: dest as cloned into, or only the band of its rows
+  // from top when streaming, and the files dest streams through
+  ::std::shared_ptr<const Im> src, mask;
+  Im dest;
+  ImReader destIn;
+  ImWriter outFile;
+  ::std::string outTemporary;  // what outFile writes to until it is renamed to out
+  int top, W, H;
+
+  int error;                      // nonzero once a stage failed
+  double decode, clone, encode;   // seconds in each stage
+  RunStats stats;                 // phases of the stages, for --stats
+
+  Job() : line(0), index(0), top(0), W(0), H(0), error(0), decode(0.0), clone(0.0), encode(0.0)
+    {}
+
+  // A job that failed while streaming leaves out as it was
+  ~Job()
+  {
+    if (outTemporary.empty()) return;
+    outFile.close();
+    remove(outTemporary.c_str());
+  }
+};
 
-// Implements poisson seamless cloning
-inline int poisson_clone(Im &src, Im &mask, Im dest, int xOff, int yOff, const char* outfilename,
-                        int mode, double param1, double param2, double param3)
+/* True if the job has the cloning flag of the given names and argc arguments */
+inline bool jobFlag(const Job &job, size_t argc, const char *shortName, const char *longName)
 {
-  // Number of pixels in dest and mask
-  int W = dest.w();
-  int H = dest.h();
-  int N = W*H;
+  return job.args.size() == argc && (job.args[7] == shortName || job.args[7] == longName);
+}
 
-  printf("Poisson cloning...\n");
+/* Decode the src, dest and mask images of a job at once, or, if streaming, src
+*  alongside the band of mask and dest rows that the mask touches.  When
+*  streaming, the rows of dest above the band go to out as they are decoded,
+*  and those below it once the band is cloned; a patch needs neither.  They
+*  go to a file beside out that replaces it once complete, since out may be
+*  dest.  Returns 0 on success */
+inline int decodeJob(Job &job, ImageCache *cache, const JobOptions &io, bool verbose)
+{
+  double start = wallTime();
+  const char *srcfilename = job.args[1].c_str();
+  const char *maskfilename = job.args[2].c_str();
+  const char *destfilename = job.args[3].c_str();
+  const char *outfilename = job.args[4].c_str();
+  bool decolor = jobFlag(job, 8, "-dec", "-decolor");
+  if (decolor && io.patch) {
+    fprintf(stderr, "Error: -decolor changes all of dest, so it cannot be written as a patch\n");
+    return job.error = 1;
+  }
 
-  /* Map pixel indices to Omega membership, given by ID <id>. An ID of -1 implies
-  *  the pixel lies outside a mask (it may still be a boundary pixel though) */
-  ::std::vector<int> toOmega (N, -1);
-  int id = 0;
-  for (int i = N - 1; i >= 0; i--) {
-    if (isWhite(mask[i])) {
-      toOmega[i] = id;
-      id++;
+  ::std::future< ::std::shared_ptr<const Im> > src =
+    ::std::async(::std::launch::async, readImage, srcfilename, cache);
+  if (io.stream) {
+    ::std::shared_ptr<Im> band (new Im);
+    int W, H;
+    bool ok = readMaskBand(maskfilename, *band, job.top, W, H) && job.destIn.open(destfilename);
+    job.src = src.get();
+    if (!ok || !job.src) return job.error = 1;
+    job.mask = band;
+    if (job.destIn.w() != W || job.destIn.h() != H) {
+      fprintf(stderr, "Usage: dest and mask images must have identical dimensions \n");
+      return job.error = 1;
+    }
+    job.W = W;
+    job.H = H;
+    if (!io.patch) {
+      job.outTemporary = temporaryBeside(outfilename);
+      if (!job.outFile.open(job.outTemporary, W, H, io.encode)) return job.error = 1;
+    }
+    job.dest = Im(W, band->h());
+    if (!copyRows(job.destIn, io.patch ? NULL : &job.outFile, job.top, decolor)) return job.error = 1;
+    for (int y = 0; y < job.dest.h(); y++) {
+      if (!job.destIn.readRow(&job.dest(0, y))) return job.error = 1;
     }
-  }
 
-  /* Now reverse the mapping now that we know how many ids we have */
-  int OMEGA_SIZE = id;
-  ::std::vector<int> toMask (OMEGA_SIZE);
-  for (int i = N - 1; i >= 0; i--) {
-    if (toOmega[i] >= 0) {
-      toMask[toOmega[i]] = i;
+    if (verbose) {
+      printf("Streaming images of size %d x %d, holding rows %d to %d\n", W, H, job.top, job.top + job.dest.h() - 1);
+      printf("Using %s pixel kernels\n", pixelKernels());
+    }
+  } else {
+    ::std::future< ::std::shared_ptr<const Im> > mask =
+      ::std::async(::std::launch::async, readImage, maskfilename, cache);
+    ::std::shared_ptr<const Im> destIm = readImage(destfilename, cache);
+    job.mask = mask.get();
+    job.src = src.get();
+    if (!destIm || !job.mask || !job.src) return job.error = 1;
+    job.dest = *destIm;
+    job.W = job.dest.w();
+    job.H = job.dest.h();
+
+    if (verbose) {
+      printf("Read images of size %d x %d\n", job.dest.w(), job.dest.h());
+      printf("Using %s pixel kernels\n", pixelKernels());
     }
-  }
 
-  /* Initialize system of equations */
-  printf("Setting up system of equations...\n");
-  // RHS
-  gsl_vector *r = gsl_vector_alloc(OMEGA_SIZE);  /* vector of "known reds" */
-  gsl_vector *g = gsl_vector_alloc(OMEGA_SIZE);  /* vector of "known greens" */
-  gsl_vector *b = gsl_vector_alloc(OMEGA_SIZE);  /* vector of "known blues" */
+    // Enforce equality between dims of dest and mask
+    if (job.dest.h() != job.mask->h() || job.dest.w() != job.mask->w()) {
+      fprintf(stderr, "Usage: dest and mask images must have identical dimensions \n");
+      return job.error = 1;
+    }
+  }
+  job.decode = wallTime() - start;
+  job.stats.add("decode", job.decode);
+  return 0;
+}
 
-  /* Sparse matrix of coefficients (LHS) */
-  gsl_spmatrix *A = gsl_spmatrix_alloc(OMEGA_SIZE, OMEGA_SIZE);
-  gsl_spmatrix *C;                               /* compressed format */
-  gsl_vector *x = gsl_vector_alloc(OMEGA_SIZE);  /* vector for solutions (LHS) */
+/* Clone src into the decoded dest of a job, by its cloning flag.  Returns 0
+*  on success */
+inline int cloneJob(Job &job, const SolverOptions &opts, bool verbose)
+{
+  double start = wallTime();
+  int argc = (int) job.args.size();
+  ::std::vector<const char *> argv;
+  for (int i = 0; i < argc; i++) {
+    argv.push_back(job.args[i].c_str());
+  }
+  const Im &src = *job.src;
+  const Im &mask = *job.mask;
+  Im &dest = job.dest;
+  const int xOff = atoi(argv[5]);
+  const int yOff = atoi(argv[6]) - job.top;
 
-  /* Iterate through the pixels in Omega... */
-  for (int id = OMEGA_SIZE - 1; id >= 0; id--) {
-    int p = toMask[id]; // Pixel index in dest and mask
-    int Np = 0;         // Number of cardinal neighbors in image
-    double r_val = 0.0; // RHS of equation
-    double g_val = 0.0; // RHS of equation
-    double b_val = 0.0; // RHS of equation
+  double extra1 = 0.0;
+  double extra2 = 0.0;
+  double extra3 = 0.0;
 
-    // Fetch neighbors
-    std::vector< std::vector<int> > neighbors = getNeighbors(p, W, H, toOmega);
+  // Flags
+  std::string d_short = "-d";
+  std::string d_long = "-direct";
+  std::string mono_short = "-mono";
+  std::string mono_long = "-monochrome";
+  std::string mx_short = "-mx";
+  std::string mx_long = "-mixed";
+  std::string f_short = "-f";
+  std::string f_long = "-flat";
+  std::string il_short = "-il";
+  std::string il_long = "-illumination";
+  std::string dec_short = "-dec";
+  std::string dec_long = "-decolor";
+  std::string rec_short = "-rec";
+  std::string rec_long = "-recolor";
+  std::string tex_short = "-tex";
+  std::string tex_long = "-texture";
 
-    // For each neighbor q....
-    for (int j = 0; j < 4; j++) {
-      int status = neighbors[j][0];
-      int q = neighbors[j][1];
+  // Use flag to determine cloning method
+  int error = 0;
+  if (argc == 8 && (d_short.compare(argv[7]) == 0 || d_long.compare(argv[7]) == 0)) {
+    // Apply direct cloning
+    error = direct_clone(src, mask, dest, xOff, yOff, verbose);
+    job.stats.add("clone", wallTime() - start);
+  } else if (argc == 8 && (mono_short.compare(argv[7]) == 0 || mono_long.compare(argv[7]) == 0)) {
+    // Convert src to monochrome and then apply poisson cloning
+    error = poisson_clone(imToMonochrome(src), mask, dest, xOff, yOff, CLONE_SEAMLESS, extra1, extra2, opts, verbose, &job.stats);
+  } else if (argc == 8 && (mx_short.compare(argv[7]) == 0 || mx_long.compare(argv[7]) == 0)) {
+    // Apply poisson cloning in mixed mode
+    error = poisson_clone(src, mask, dest, xOff, yOff, CLONE_MIXED, extra1, extra2, opts, verbose, &job.stats);
+  } else if (argc == 10 && (f_short.compare(argv[7]) == 0 || f_long.compare(argv[7]) == 0)) {
+    // Apply poisson cloning in flatten mode (only keep high gradients)
+    extra1 = atof(argv[8]);
+    extra2 = atof(argv[9]);
+    error = poisson_clone(src, mask, dest, xOff, yOff, CLONE_FLAT, extra1, extra2, opts, verbose, &job.stats);
+  } else if (argc == 10 && (il_short.compare(argv[7]) == 0 || il_long.compare(argv[7]) == 0)) {
+    // Apply poisson cloning with local illumination changes
+    extra1 = atof(argv[8]);
+    extra2 = atof(argv[9]);
+    error = poisson_clone(src, mask, dest, xOff, yOff, CLONE_ILLUMINATION, extra1, extra2, opts, verbose, &job.stats);
+  } else if (argc == 8 && (dec_short.compare(argv[7]) == 0 || dec_long.compare(argv[7]) == 0)) {
+    // Convert dest to monochrome and then apply poisson cloning
+    dest = imToMonochrome(dest);
+    error = poisson_clone(src, mask, dest, xOff, yOff, CLONE_SEAMLESS, extra1, extra2, opts, verbose, &job.stats);
+  } else if (argc == 11 && (rec_short.compare(argv[7]) == 0 || rec_long.compare(argv[7]) == 0)) {
+    // Recolor souce and then apply poisson image blending
+    extra1 = atof(argv[8]);
+    extra2 = atof(argv[9]);
+    extra3 = atof(argv[10]);
+    error = poisson_clone(imRecolor(src, extra1, extra2, extra3), mask, dest, xOff, yOff, CLONE_SEAMLESS, extra1, extra2, opts, verbose, &job.stats);
+  } else if (argc == 9 && (tex_short.compare(argv[7]) == 0 || tex_long.compare(argv[7]) == 0)) {
+    // Apply poisson cloning but try to keep the grain (similar to mixed, but with threshholds)
+    extra1 = atof(argv[8]);
+    error = poisson_clone(src, mask, dest, xOff, yOff, CLONE_TEXTURE, extra1, extra2, opts, verbose, &job.stats);
+  } else {
+    // Apply Poisson seamless cloning
+    error = poisson_clone(src, mask, dest, xOff, yOff, CLONE_SEAMLESS, extra1, extra2, opts, verbose, &job.stats);
+  }
+  job.clone = wallTime() - start;
+  return job.error = error;
+}
 
-      // Ignore pixels outside the image
-      if (status == -1) {
-        continue;
-      }
+/* Write the output of a job: the patch, the band and the rest of dest, or all
+*  of it.  The decoded images are released first.  Returns 0 on success */
+inline int encodeJob(Job &job, const JobOptions &io)
+{
+  double start = wallTime();
+  bool direct = jobFlag(job, 8, "-d", "-direct");
+  bool written;
+  job.src.reset();
+  if (io.patch) {
+    written = writePatch(job.dest, *job.mask, job.top, job.W, job.H, job.args[4].c_str(), io.encode);
+  } else if (io.stream) {
+    written = true;
+    for (int y = 0; y < job.dest.h(); y++) {
+      written = written && job.outFile.writeRow(&job.dest(0, y));
+    }
+    written = written && copyRows(job.destIn, &job.outFile, job.destIn.h() - job.destIn.rowsRead(),
+                                  jobFlag(job, 8, "-dec", "-decolor"));
+    written = job.outFile.close() && written;
+    job.destIn.close();
+    written = written && rename(job.outTemporary.c_str(), job.args[4].c_str()) == 0;
+    if (written) job.outTemporary.clear();
+  } else {
+    written = job.dest.write(job.args[4], io.encode);
+  }
+  job.mask.reset();
+  job.dest = Im();
+  job.encode = wallTime() - start;
+  job.stats.add("encode", job.encode);
+  if (!written) {
+    fprintf(stderr, "Error: %s cloning write failed\n", direct ? "direct" : "poisson");
+    return job.error = 1;
+  }
+  return 0;
+}
 
-      Np++; // Count the neighbor
-      // Guidance constraints
-      r_val += guidance(src, dest, p, q, xOff, yOff, 0, mode, param1, param2, param3);
-      g_val += guidance(src, dest, p, q, xOff, yOff, 1, mode, param1, param2, param3);
-      b_val += guidance(src, dest, p, q, xOff, yOff, 2, mode, param1, param2, param3);
-
-      // For q in Omega
-      if (status == 1) {
-        // -fq component
-        int q_id = toOmega[q];
-        gsl_spmatrix_set(A, id, q_id, -1.0);
-      }
-      // For q in boundary of Omega
-      if (status == 0) {
-        // f* boundary constraint
-        r_val += (double) dest[q][0]/255.0;
-        g_val += (double) dest[q][1]/255.0;
-        b_val += (double) dest[q][2]/255.0;
-      }
+/* Append text to json as a JSON string */
+inline void jsonString(::std::string &json, const ::std::string &text)
+{
+  json += '"';
+  for (size_t i = 0; i < text.size(); i++) {
+    unsigned char c = text[i];
+    if (c == '"' || c == '\\') {
+      json += '\\';
+      json += c;
+    } else if (c < 0x20) {
+      char escaped[8];
+      sprintf(escaped, "\\u%04x", c);
+      json += escaped;
+    } else {
+      json += c;
     }
+  }
+  json += '"';
+}
+
+/* Append x to json as a JSON number; null if it is not finite */
+inline void jsonNumber(::std::string &json, double x)
+{
+  char number[32];
+  if (::std::isfinite(x)) {
+    sprintf(number, "%.9g", x);
+  } else {
+    sprintf(number, "null");
+  }
+  json += number;
+}
 
-    // Np*fp component
-    gsl_spmatrix_set(A, id, id, (double) Np);
-    // Record constraints
-    gsl_vector_set(r, id, r_val);
-    gsl_vector_set(g, id, g_val);
-    gsl_vector_set(b, id, b_val);
+/* The stats of a job as a JSON object: its arguments, whether it was written,
+*  the phases it went through and, for a Poisson solve, the solver, status,
+*  iterations and residual history of each channel of each component */
+inline ::std::string jobStats(const Job &job)
+{
+  const RunStats &stats = job.stats;
+  ::std::string json = "{\"line\": " + ::std::to_string(job.line) + ", \"args\": [";
+  for (size_t i = 1; i < job.args.size(); i++) {
+    if (i > 1) json += ", ";
+    jsonString(json, job.args[i]);
   }
+  json += "], \"status\": ";
+  jsonString(json, job.error ? "failed" : "written");
 
-  /* convert to compressed column format */
-  C = gsl_spmatrix_ccs(A);
+  /* Whether every channel converged; null if nothing was solved */
+  bool converged = true;
+  for (size_t k = 0; k < stats.report.components.size(); k++) {
+    converged = converged && stats.report.components[k].status == GSL_SUCCESS;
+  }
+  json += ", \"converged\": ";
+  json += stats.report.components.empty() ? "null" : converged ? "true" : "false";
+  json += ", \"unknowns\": " + ::std::to_string(stats.unknowns) + ", \"phases\": [";
+  for (size_t i = 0; i < stats.phases.size(); i++) {
+    if (i > 0) json += ", ";
+    json += "{\"name\": ";
+    jsonString(json, stats.phases[i].name);
+    json += ", \"seconds\": ";
+    jsonNumber(json, stats.phases[i].seconds);
+    json += ", \"peak_kb\": " + ::std::to_string(stats.phases[i].peakKB) + "}";
+  }
 
-  /* Sparsely solve the systems of equations for each channel */
-  for (int c = 0; c < 3; c++) {
-    /* Init solutions to src for the first channel; then use prev channel for speedup */
-    for (int id = OMEGA_SIZE - 1; id >= 0; id--) {
-      double val = sourcePixel(src, W, toMask[id], xOff, yOff, c);
-      gsl_vector_set(x, id, val);
+  json += "], \"components\": [";
+  for (size_t k = 0; k < stats.report.components.size(); k++) {
+    const ComponentResult &res = stats.report.components[k];
+    if (k > 0) json += ", ";
+    json += "\n  {\"unknowns\": " + ::std::to_string(stats.sizes[k]) + ", \"solver\": ";
+    jsonString(json, solverName(res.solver));
+    json += ", \"status\": " + ::std::to_string(res.status);
+    json += ", \"converged\": ";
+    json += res.status == GSL_SUCCESS ? "true" : "false";
+    json += ", \"iterations\": [" + ::std::to_string(res.iter[0]) + ", " + ::std::to_string(res.iter[1]) + ", " +
+            ::std::to_string(res.iter[2]) + "]";
+    json += ", \"levels\": " + ::std::to_string(res.levels) + ", \"steps\": " + ::std::to_string(res.steps);
+    json += ", \"memory\": " + ::std::to_string(res.memory);
+    json += ", \"cached\": ";
+    json += res.cached ? "true" : "false";
+    json += ", \"matrix_seconds\": ";
+    jsonNumber(json, res.matrix);
+    json += ", \"seconds\": ";
+    jsonNumber(json, res.seconds);
+    json += ", \"residuals\": [";
+    for (int c = 0; c < 3; c++) {
+      if (c > 0) json += ", ";
+      json += "[";
+      for (size_t i = 0; i < res.residuals[c].size(); i++) {
+        if (i > 0) json += ", ";
+        jsonNumber(json, res.residuals[c][i]);
+      }
+      json += "]";
     }
+    json += "]}";
+  }
+  json += "]}";
+  return json;
+}
 
-    printf("Solving for channel %d\n", c);
-    if (c == 0) solve(C, x, r, OMEGA_SIZE);
-    else if (c == 1) solve(C, x, g, OMEGA_SIZE);
-    else if (c == 2) solve(C, x, b, OMEGA_SIZE);
+/* Write the stats of jobs, and the wall time and peak memory of the run, to
+*  path as JSON.  Returns false if the file cannot be written */
+inline bool writeStats(const char *path, const ::std::vector< ::std::string> &jobs, double seconds)
+{
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Error: cannot write stats to %s\n", path);
+    return false;
+  }
+  fprintf(file, "{\"seconds\": %.9g, \"peak_kb\": %ld, \"jobs\": [", seconds, peakRSS());
+  for (size_t k = 0; k < jobs.size(); k++) {
+    fprintf(file, "%s\n%s", k > 0 ? "," : "", jobs[k].c_str());
+  }
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0;
+}
 
-    /* Copy into dest */
-    for (int j = OMEGA_SIZE - 1; j >= 0; j--) {
-      setPixel(dest, toMask[j], gsl_vector_get(x, j), c);
+/* Run one clone operation, given as on the command line: argv[1] to argv[6]
+*  are src, mask, dest, out, xOffset and yOffset, followed by the cloning flag
+*  and its parameters, if any.  When streaming, dest is copied to out a row
+*  at a time, and only the rows the mask touches are held and cloned into.
+*  For a patch, only the frame of Omega is written to out, with its place in
+*  dest in a sidecar.  With io.stats set, the stats of the job are written
+*  there, whether or not it failed.  Returns 0 on success */
+inline int runJob(int argc, char *argv[], const SolverOptions &opts, const JobOptions &io, ImageCache *cache,
+                  bool verbose)
+{
+  double start = wallTime();
+  Job job;
+  job.args.assign(argv, argv + argc);
+  if (!decodeJob(job, cache, io, verbose) && !cloneJob(job, opts, verbose)) {
+    encodeJob(job, io);
+  }
+  if (!io.stats.empty() &&
+      !writeStats(io.stats.c_str(), ::std::vector< ::std::string>(1, jobStats(job)), wallTime() - start)) {
+    return 1;
+  }
+  return job.error;
+}
+
+/* Run the jobs of a manifest, one per line in the form of the command line
+*  arguments (src mask dest out xOffset yOffset [-FLAG params]), through a
+*  pipeline whose stages share decoded images.  Blank lines and lines starting with #
+*  are skipped.  The options in io apply to every job; when streaming, only
+*  src images are shared.  A job that reads or writes the out of an earlier
+*  line is decoded only once that line has been written, and fails if it
+*  failed.  Stats are written for the jobs in the order they finished.  Returns
+*  the number of jobs that failed */
+inline int runBatch(const char *manifest, const SolverOptions &opts, const JobOptions &io, int workers,
+                    size_t imageBudget)
+{
+  FILE *file = fopen(manifest, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Error: cannot open manifest %s\n", manifest);
+    return 1;
+  }
+  ::std::vector< ::std::vector< ::std::string> > jobs;
+  ::std::vector<int> lines;
+  ::std::vector<int> after;  // the last earlier job whose out a job uses, or -1
+  ::std::unordered_map< ::std::string, int> writer;
+  char buffer[4096];
+  for (int line = 1; fgets(buffer, sizeof(buffer), file); line++) {
+    ::std::vector< ::std::string> args (1, "poisson_clone");
+    for (char *token = strtok(buffer, " \t\r\n"); token; token = strtok(NULL, " \t\r\n")) {
+      args.push_back(token);
+    }
+    if (args.size() == 1 || args[1][0] == '#') continue;
+    if (args.size() < 7) {
+      fprintf(stderr, "Error: line %d of %s has fewer than 6 arguments\n", line, manifest);
+      fclose(file);
+      return 1;
     }
+    int k = (int) jobs.size();
+    after.push_back(-1);
+    for (int i = 1; i <= 4; i++) {
+      auto found = writer.find(args[i]);
+      if (found != writer.end()) after[k] = ::std::max(after[k], found->second);
+    }
+    writer[args[4]] = k;
+    jobs.push_back(args);
+    lines.push_back(line);
+  }
+  fclose(file);
+
+  /* Decoding, cloning and encoding run as a pipeline of three stages with
+  *  workers threads each, so that later jobs decode and earlier ones encode
+  *  while a job is cloned.  The queues between the stages hold up to workers
+  *  jobs, which bounds the decoded images in memory */
+  printf("Running %zu jobs on %d workers per stage\n", jobs.size(), workers);
+  printf("Using %s pixel kernels\n", pixelKernels());
+  double start = wallTime();
+  ImageCache cache (imageBudget, io.shared);
+  BoundedQueue<Job *> decoded (workers), cloned (workers);
+  ::std::atomic<int> next (0), failed (0);
+  ::std::mutex output;
+  double decodeSeconds = 0.0, cloneSeconds = 0.0, encodeSeconds = 0.0;
+  ::std::vector< ::std::string> stats;
+
+  /* Jobs are decoded in manifest order, so the job one waits for has already
+  *  passed decoding and the wait always ends */
+  ::std::vector<int> finished (jobs.size(), 0);  // 1 once written, -1 once failed
+  ::std::condition_variable written;
+  auto decodeStage = [&]() {
+    for (int k = next++; k < (int) jobs.size(); k = next++) {
+      Job *job = new Job;
+      job->args = jobs[k];
+      job->line = lines[k];
+      job->index = k;
+      int status = 1;
+      if (after[k] >= 0) {
+        ::std::unique_lock< ::std::mutex> guard(output);
+        written.wait(guard, [&]() { return finished[after[k]] != 0; });
+        status = finished[after[k]];
+      }
+      if (status < 0) {
+        fprintf(stderr, "Error: line %d uses the output of line %d, which failed\n", job->line, lines[after[k]]);
+        job->error = 1;
+      } else {
+        decodeJob(*job, &cache, io, false);
+      }
+      decoded.push(job);
+    }
+  };
+  auto cloneStage = [&]() {
+    Job *job;
+    while (decoded.pop(job)) {
+      if (!job->error) cloneJob(*job, opts, false);
+      cloned.push(job);
+    }
+  };
+  auto encodeStage = [&]() {
+    Job *job;
+    while (cloned.pop(job)) {
+      if (!job->error) encodeJob(*job, io);
+      if (job->error) failed++;
+      cache.forget(job->args[4]);
+      ::std::lock_guard< ::std::mutex> guard(output);
+      finished[job->index] = job->error ? -1 : 1;
+      written.notify_all();
+      printf("Line %d: %s %s in %.3f s (decode %.3f s, clone %.3f s, encode %.3f s)\n", job->line,
+             job->args[4].c_str(), job->error ? "failed" : "written", job->decode + job->clone + job->encode,
+             job->decode, job->clone, job->encode);
+      decodeSeconds += job->decode;
+      cloneSeconds += job->clone;
+      encodeSeconds += job->encode;
+      if (!io.stats.empty()) stats.push_back(jobStats(*job));
+      delete job;
+    }
+  };
+  ::std::vector< ::std::thread> decoders, cloners, encoders;
+  for (int w = 0; w < workers; w++) {
+    decoders.push_back(::std::thread(decodeStage));
+    cloners.push_back(::std::thread(cloneStage));
+    encoders.push_back(::std::thread(encodeStage));
+  }
+  for (int w = 0; w < workers; w++) {
+    decoders[w].join();
+  }
+  decoded.close();
+  for (int w = 0; w < workers; w++) {
+    cloners[w].join();
+  }
+  cloned.close();
+  for (int w = 0; w < workers; w++) {
+    encoders[w].join();
   }
 
-  /* Free mem */
-  gsl_spmatrix_free(A);
-  gsl_spmatrix_free(C);
-  gsl_vector_free(x);
-  gsl_vector_free(r);
-  gsl_vector_free(g);
-  gsl_vector_free(b);
+  double seconds = wallTime() - start;
+  printf("Ran %zu jobs in %.3f s (%.1f jobs/s), %d failed\n", jobs.size(), seconds,
+         jobs.size() / ::std::max(seconds, 1e-9), (int) failed);
+  printf("Stage time: decode %.3f s, clone %.3f s, encode %.3f s; %.2fx the wall time\n",
+         decodeSeconds, cloneSeconds, encodeSeconds,
+         (decodeSeconds + cloneSeconds + encodeSeconds) / ::std::max(seconds, 1e-9));
+  printf("Image cache: %d of %d reads decoded once already\n", cache.hits(), cache.lookups());
+  if (!io.shared.empty()) {
+    printf("Shared images: %d read from %s instead of decoded\n", cache.sharedHits(), io.shared.c_str());
+  }
+  printf("Peak memory: %ld KB\n", peakRSS());
+  if (!io.stats.empty() && !writeStats(io.stats.c_str(), stats, seconds)) return 1;
+  return failed;
+}
 
-  /* Write image back out */
-  if (!dest.write(outfilename)){
-    fprintf(stderr, "Error: poisson cloning write failed\n");
+/* One layer of a composite: src cloned at (xOff, yOff) over the white pixels
+*  of mask, with a cloning flag as on the command line */
+struct Layer {
+  int line;                // in the layer list
+  ::std::string src;
+  bool direct;             // -d: copy the src pixels as they are
+  int transform;           // 0, or 1 for -mono and 2 for -rec, applied to src
+  double scale[3];         // for -rec
+  CloneMode mode;
+  double param1, param2;
+  int xOff, yOff;
+  ::std::shared_ptr<const Im> mask;
+  int left, top, width, height;  // frame of Omega in dest
+  int wave;                // layers of a wave do not touch each other
+};
+
+/* Parse a line of a layer list, src mask xOffset yOffset [-FLAG params], into
+*  layer, reading the mask through cache.  Returns 0 on success */
+inline int parseLayer(const ::std::vector< ::std::string> &args, Layer &layer, ImageCache &cache)
+{
+  layer.src = args[0];
+  layer.xOff = atoi(args[2].c_str());
+  layer.yOff = atoi(args[3].c_str());
+  layer.direct = false;
+  layer.transform = 0;
+  layer.mode = CLONE_SEAMLESS;
+  layer.param1 = layer.param2 = 0.0;
+
+  std::string flag = args.size() > 4 ? args[4] : "";
+  size_t n = args.size();
+  if (n == 5 && (flag == "-d" || flag == "-direct")) {
+    layer.direct = true;
+  } else if (n == 5 && (flag == "-mono" || flag == "-monochrome")) {
+    layer.transform = 1;
+  } else if (n == 5 && (flag == "-mx" || flag == "-mixed")) {
+    layer.mode = CLONE_MIXED;
+  } else if (n == 7 && (flag == "-f" || flag == "-flat")) {
+    layer.mode = CLONE_FLAT;
+    layer.param1 = atof(args[5].c_str());
+    layer.param2 = atof(args[6].c_str());
+  } else if (n == 7 && (flag == "-il" || flag == "-illumination")) {
+    layer.mode = CLONE_ILLUMINATION;
+    layer.param1 = atof(args[5].c_str());
+    layer.param2 = atof(args[6].c_str());
+  } else if (n == 8 && (flag == "-rec" || flag == "-recolor")) {
+    layer.transform = 2;
+    for (int c = 0; c < 3; c++) {
+      layer.scale[c] = atof(args[5 + c].c_str());
+    }
+  } else if (n == 6 && (flag == "-tex" || flag == "-texture")) {
+    layer.mode = CLONE_TEXTURE;
+    layer.param1 = atof(args[5].c_str());
+  } else if (n != 4) {
+    fprintf(stderr, "Error: line %d: unknown flag %s, or wrong number of parameters "
+            "(-dec does not apply to a single layer)\n", layer.line, flag.c_str());
     return 1;
   }
 
+  layer.mask = cache.get(args[1]);
+  if (!layer.mask) return 1;
+  maskFrame(*layer.mask, layer.left, layer.top, layer.width, layer.height);
   return 0;
 }
 
-/*******************************************************************************
-Direct Cloning
-*******************************************************************************/
+/* True if the frames of two layers overlap, so that one reads or writes pixels
+*  that the other writes */
+inline bool layersTouch(const Layer &a, const Layer &b)
+{
+  return a.left < b.left + b.width && b.left < a.left + a.width &&
+         a.top < b.top + b.height && b.top < a.top + a.height;
+}
 
-// Implements direct [seamed] cloning
-inline int direct_clone(Im &src, Im &mask, Im dest, int xOff, int yOff, const char* outfilename)
+/* Clone one layer into canvas, with dest of the size of canvas.  Returns 0 on
+*  success */
+inline int applyLayer(const Layer &layer, PlanarIm &canvas, const SolverOptions &opts, ImageCache &cache)
 {
-  // Number of pixels in dest and mask
-  int W = dest.w();
-  int H = dest.h();
+  ::std::shared_ptr<const Im> srcIm = cache.get(layer.src);
+  if (!srcIm) return 1;
+  const Im &mask = *layer.mask;
+  const Im *src = srcIm.get();
+  Im changed;
+  if (layer.transform == 1) {
+    changed = imToMonochrome(*src);
+    src = &changed;
+  } else if (layer.transform == 2) {
+    changed = imRecolor(*src, layer.scale[0], layer.scale[1], layer.scale[2]);
+    src = &changed;
+  }
 
-  int srcW = src.w();
-  int srcH = src.h();
+  if (!layer.direct) {
+    CloneSession session (canvas, mask, opts);
+    int status = session.clone(*src, layer.xOff, layer.yOff, layer.mode, layer.param1, layer.param2, canvas);
+    if (status != GSL_SUCCESS) {
+      fprintf(stderr, "Warning: line %d: not every channel converged\n", layer.line);
+    }
+    return 0;
+  }
 
-  printf("Direct cloning...\n");
-
-  /* Clone masked region from src to dest */
-  for (int y = H - 1; y >= 0; y--) {
-    for (int x = W - 1; x >= 0; x--) {
-      // Copy src onto dest if mask is white
-      if (isWhite(mask(x, y))) {
-        int u = x - xOff;
-        int v = y - yOff;
-        if (0 <= u && 0 <= v && u < srcW && v < srcH) {
-          Color &src_pixel = src(u, v);
-          Color &dest_pixel = dest(x, y);
-
-          for (int j = 0; j < 3; j++)
-          dest_pixel[j] = (unsigned char) src_pixel[j];
-        }
+  /* Direct cloning, as in direct_clone, into the float planes */
+  int xa = ::std::max(layer.xOff, 0);
+  int xb = ::std::min(canvas.w(), src->w() + layer.xOff);
+  int n = xb - xa;
+  ::std::vector<uint64_t> white;
+  ::std::vector<float> planes (3 * (size_t) ::std::max(n, 0));
+  for (int y = ::std::max(layer.yOff, 0); n > 0 && y < ::std::min(canvas.h(), src->h() + layer.yOff); y++) {
+    whiteRow(mask, xa, y, n, white);
+    bytesToPlanes(&(*src)(xa - layer.xOff, y - layer.yOff).r, &planes[0], &planes[n], &planes[2 * n], n);
+    for (int i = 0; i < n; i++) {
+      if (!bitSet(white, i)) continue;
+      for (int c = 0; c < 3; c++) {
+        canvas(xa + i, y, c) = planes[c * n + i];
       }
     }
   }
+  return 0;
+}
 
-  /* Write image back out */
-  if (!dest.write(outfilename)) {
-    fprintf(stderr, "Error: direct cloning write failed\n");
+/* Composite the layers of a list, one per line in the form src mask xOffset
+*  yOffset [-FLAG params], in order onto dest, and write the result once to
+*  out with the given encoder profile.  Between layers dest is kept as float
+*  planes, so that no layer sees the 8-bit rounding of an earlier one.  Layers
+*  whose frames do not overlap any layer of the same wave are solved at once,
+*  on up to workers threads.  Returns 0 on success */
+inline int runLayers(const char *list, const char *destfilename, const char *outfilename,
+                     const SolverOptions &opts, int workers, size_t imageBudget,
+                     ImEncode encode, const ::std::string &shared)
+{
+  double start = wallTime();
+  Im dest;
+  if (!dest.read(destfilename)) return 1;
+  ImageCache cache (imageBudget, shared);
+
+  FILE *file = fopen(list, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Error: cannot open layer list %s\n", list);
     return 1;
   }
+  ::std::vector<Layer> layers;
+  char buffer[4096];
+  int error = 0;
+  for (int line = 1; !error && fgets(buffer, sizeof(buffer), file); line++) {
+    ::std::vector< ::std::string> args;
+    for (char *token = strtok(buffer, " \t\r\n"); token; token = strtok(NULL, " \t\r\n")) {
+      args.push_back(token);
+    }
+    if (args.empty() || args[0][0] == '#') continue;
+    if (args.size() < 4) {
+      fprintf(stderr, "Error: line %d of %s has fewer than 4 arguments\n", line, list);
+      error = 1;
+      break;
+    }
+    layers.push_back(Layer());
+    layers.back().line = line;
+    error = parseLayer(args, layers.back(), cache);
+    if (!error && (layers.back().mask->w() != dest.w() || layers.back().mask->h() != dest.h())) {
+      fprintf(stderr, "Error: line %d: dest and mask images must have identical dimensions\n", line);
+      error = 1;
+    }
+  }
+  fclose(file);
+  if (error) return 1;
+
+  /* Each layer goes in the wave after the last earlier layer it overlaps */
+  int waves = 0;
+  for (size_t j = 0; j < layers.size(); j++) {
+    layers[j].wave = 0;
+    for (size_t i = 0; i < j; i++) {
+      if (layersTouch(layers[i], layers[j])) {
+        layers[j].wave = ::std::max(layers[j].wave, layers[i].wave + 1);
+      }
+    }
+    waves = ::std::max(waves, layers[j].wave + 1);
+  }
+  printf("Compositing %zu layers onto %d x %d in %d waves\n", layers.size(), dest.w(), dest.h(), waves);
+  printf("Using %s pixel kernels\n", pixelKernels());
+
+  PlanarIm canvas (dest, 0, 0, dest.w(), dest.h());
+  ::std::mutex output;
+  ::std::atomic<int> failed (0);
+  for (int wave = 0; wave < waves; wave++) {
+    ::std::vector<const Layer *> todo;
+    for (size_t j = 0; j < layers.size(); j++) {
+      if (layers[j].wave == wave) todo.push_back(&layers[j]);
+    }
+    ::std::atomic<int> next (0);
+    auto work = [&]() {
+      for (int k = next++; k < (int) todo.size(); k = next++) {
+        double begin = wallTime();
+        int error = applyLayer(*todo[k], canvas, opts, cache);
+        if (error) failed++;
+        ::std::lock_guard< ::std::mutex> guard(output);
+        printf("Line %d: %s %s at (%d, %d) in wave %d, %.3f s\n", todo[k]->line, todo[k]->src.c_str(),
+               error ? "failed" : "cloned", todo[k]->xOff, todo[k]->yOff, wave, wallTime() - begin);
+      }
+    };
+    ::std::vector< ::std::thread> threads;
+    for (int w = 1; w < ::std::min(workers, (int) todo.size()); w++) {
+      threads.push_back(::std::thread(work));
+    }
+    work();
+    for (size_t w = 0; w < threads.size(); w++) {
+      threads[w].join();
+    }
+  }
+  if (failed) return 1;
 
+  /* Round to 8 bits once, and write */
+  canvas.toIm(dest, 0, 0);
+  if (!dest.write(outfilename, encode)) {
+    fprintf(stderr, "Error: layer compositing write failed\n");
+    return 1;
+  }
+  printf("Composited %zu layers in %.3f s\n", layers.size(), wallTime() - start);
+  printf("Peak memory: %ld KB\n", peakRSS());
   return 0;
 }
 
@@ -495,6 +1142,7 @@ Main
 * $ ./poisson_clone ./test_images/perez-fig3b-src1-orig.png ./test_images/perez-fig3b-mask1.png ./test_images/perez-fig3b-dst.png out.png 33 24
 * $ ./poisson_clone ./test_images/perez-fig3b-src2-orig.png ./test_images/perez-fig3b-mask2.png ./out.png out.png 20 110
 * $ ./poisson_clone ./test_images/perez-fig3b-src2-orig.png ./test_images/perez-fig3b-mask3.png ./out.png out.png -67 98
+* $ ./poisson_clone --layers ./test_images/perez-fig3b-layers.txt ./test_images/perez-fig3b-dst.png out.png
 * $ nice -20 ./poisson_clone ./test_images/perez-fig5-src.png ./test_images/perez-fig5-mask.png ./test_images/perez-fig5-dst.png ./results/fig5_mono.png -40 52 -mono
 * $ nice -20 ./poisson_clone ./test_images/perez-fig6-src.png ./test_images/perez-fig6-mask.png ./test_images/perez-fig6-dst.png ./results/fig6_mixed.png 25 20 -mx
 *
@@ -503,119 +1151,171 @@ Main
 * $ nice -20 ./poisson_clone ./test_images/perez-fig10a-src.png ./test_images/perez-fig10a-mask.png ./test_images/perez-fig10a-src.png ./results/fig10a_illum.png 0 0 -il .2 .2
 *
 * $ ./poisson_clone ./custom_images/eisg.png ./custom_images/wash-mask.jpg ./custom_images/wash.jpg out.png 486 300
+*
+* $ ./poisson_clone ./test_images/perez-fig6-src.png ./test_images/perez-fig6-mask.png ./test_images/perez-fig6-dst.png out.png 25 20 -mx --solver fmg
+* $ ./poisson_clone ./test_images/perez-fig10a-src.png ./test_images/perez-fig10a-mask.png ./test_images/perez-fig10a-src.png out.png 0 0 -il .2 .2 --solver mg --threads 8
+* $ ./poisson_clone ./test_images/perez-fig9-src.png ./rect-mask.png ./test_images/perez-fig9-src.png out.png 0 0 -f 5 .95 --solver fft
+* $ ./poisson_clone ./test_images/perez-fig4a-src-orig.png ./test_images/perez-fig4a-mask.png ./test_images/perez-fig4a-dst.png out.png -11 52 --solver cholesky --cache /tmp
 */
 int main(int argc, char *argv[])
 {
-  if (argc < 7) {
-    fprintf(stderr, "Usage: %s src.png mask.png dest.png out.png xOffset yOffset [-FLAG]\n", argv[0]);
+  /* Pull out "--option value" pairs so that the positional arguments and the
+  *  cloning flags below are parsed exactly as before */
+  SolverOptions opts;
+  const char *batch = NULL;   // manifest of a batch of jobs
+  const char *layers = NULL;  // list of layers to composite onto one dest
+  JobOptions io;
+  const char *apply = NULL;   // patch to apply to a dest
+  int jobs = 1;               // jobs run at once in a batch
+  size_t imageBudget = (size_t) 1024 * 1024 * 1024;  // decoded images kept in a batch
+  int nargs = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--solver" && i + 1 < argc) {
+      std::string name = argv[++i];
+      if (name == "gmres") {
+        opts.solver = SOLVER_GMRES;
+      } else if (name == "mg" || name == "multigrid") {
+        opts.solver = SOLVER_MG;
+      } else if (name == "fmg") {
+        opts.solver = SOLVER_FMG;
+      } else if (name == "pcg") {
+        opts.solver = SOLVER_PCG;
+      } else if (name == "fft") {
+        opts.solver = SOLVER_FFT;
+      } else if (name == "cholesky") {
+        opts.solver = SOLVER_CHOLESKY;
+      } else if (name == "auto") {
+        opts.solver = SOLVER_AUTO;
+      } else {
+        fprintf(stderr, "Unknown solver %s (expected auto, gmres, mg, fmg, pcg, fft or cholesky)\n", name.c_str());
+        exit(1);
+      }
+    } else if (arg == "--threads" && i + 1 < argc) {
+      opts.threads = atoi(argv[++i]);
+      if (opts.threads < 1) {
+        fprintf(stderr, "Number of threads must be at least 1\n");
+        exit(1);
+      }
+    } else if (arg == "--precision" && i + 1 < argc) {
+      std::string name = argv[++i];
+      if (name == "double") {
+        opts.precision = PRECISION_DOUBLE;
+      } else if (name == "single") {
+        opts.precision = PRECISION_SINGLE;
+      } else if (name == "mixed") {
+        opts.precision = PRECISION_MIXED;
+      } else {
+        fprintf(stderr, "Unknown precision %s (expected double, single or mixed)\n", name.c_str());
+        exit(1);
+      }
+    } else if (arg == "--batch" && i + 1 < argc) {
+      batch = argv[++i];
+    } else if (arg == "--layers" && i + 1 < argc) {
+      layers = argv[++i];
+    } else if (arg == "--jobs" && i + 1 < argc) {
+      jobs = atoi(argv[++i]);
+      if (jobs < 1) {
+        fprintf(stderr, "Number of jobs must be at least 1\n");
+        exit(1);
+      }
+    } else if (arg == "--shared-images" && i + 1 < argc) {
+      io.shared = argv[++i];
+    } else if (arg == "--image-cache" && i + 1 < argc) {
+      imageBudget = (size_t) atof(argv[++i]) * 1024 * 1024;
+    } else if (arg == "--cache" && i + 1 < argc) {
+      opts.cache = argv[++i];
+    } else if (arg == "--stream") {
+      io.stream = true;
+    } else if (arg == "--patch") {
+      io.patch = true;
+    } else if (arg == "--encode" && i + 1 < argc) {
+      std::string name = argv[++i];
+      if (name == "default") {
+        io.encode = IM_ENCODE_DEFAULT;
+      } else if (name == "fastest") {
+        io.encode = IM_ENCODE_FASTEST;
+      } else if (name == "balanced") {
+        io.encode = IM_ENCODE_BALANCED;
+      } else if (name == "smallest") {
+        io.encode = IM_ENCODE_SMALLEST;
+      } else {
+        fprintf(stderr, "Unknown encoder profile %s (expected default, fastest, balanced or smallest)\n", name.c_str());
+        exit(1);
+      }
+    } else if (arg == "--stats" && i + 1 < argc) {
+      io.stats = argv[++i];
+    } else if (arg == "--apply" && i + 1 < argc) {
+      apply = argv[++i];
+    } else if (arg == "--compare") {
+      opts.compare = true;
+    } else if (arg == "--precond" && i + 1 < argc) {
+      std::string name = argv[++i];
+      if (name == "jacobi") {
+        opts.precond = PRECOND_JACOBI;
+      } else if (name == "ic0") {
+        opts.precond = PRECOND_IC0;
+      } else if (name == "ssor") {
+        opts.precond = PRECOND_SSOR;
+      } else {
+        fprintf(stderr, "Unknown preconditioner %s (expected jacobi, ic0 or ssor)\n", name.c_str());
+        exit(1);
+      }
+    } else {
+      argv[nargs++] = argv[i];
+    }
+  }
+  argc = nargs;
+  if (opts.precision != PRECISION_DOUBLE && opts.solver != SOLVER_PCG) {
+    fprintf(stderr, "Warning: --precision only applies to --solver pcg\n");
+  }
+  if (io.stream && layers) {
+    fprintf(stderr, "Warning: --stream does not apply to --layers\n");
+  }
+  if (io.patch && layers) {
+    fprintf(stderr, "Warning: --patch does not apply to --layers\n");
+  }
+  if (!io.stats.empty() && (layers || apply)) {
+    fprintf(stderr, "Warning: --stats does not apply to --layers or --apply\n");
+  }
+  if (!opts.cache.empty() && opts.solver != SOLVER_CHOLESKY) {
+    fprintf(stderr, "Warning: --cache only applies to --solver cholesky\n");
+  }
+
+  if (argc < 7 && !batch && !((layers || apply) && argc == 3)) {
+    fprintf(stderr, "Usage: %s src.png mask.png dest.png out.png xOffset yOffset [-FLAG] [--OPTION value]\n", argv[0]);
+    fprintf(stderr, "       %s --layers layers.txt dest.png out.png [--OPTION value]\n", argv[0]);
+    fprintf(stderr, "       %s --apply patch.png dest.png out.png\n", argv[0]);
     fprintf(stderr, "Valid Flags:\n   * (-d || -direct)\n   * (-mono || -monochrome)\n   * ");
     fprintf(stderr, "(-mx || -mixed)\n   * ((-f || -flat) threshold factor)\n   * ");
     fprintf(stderr, "((-il || -illumination) alpha beta)\n   * (-dec || -decolor)\n   * ");
     fprintf(stderr, "((-rec || -recolor) scaleR scaleG scaleB)\n   * ((-tex || -texture) threshold)\n");
+    fprintf(stderr, "Valid Options:\n   * --solver (auto || gmres || mg || fmg || pcg || fft || cholesky)\n");
+    fprintf(stderr, "   * --precond (jacobi || ic0 || ssor)\n");
+    fprintf(stderr, "   * --precision (double || single || mixed) [--compare]\n");
+    fprintf(stderr, "   * --cache DIR (with --solver cholesky)\n");
+    fprintf(stderr, "   * --threads N\n");
+    fprintf(stderr, "   * --stream\n");
+    fprintf(stderr, "   * --patch (writes out.png and out.png.patch)\n");
+    fprintf(stderr, "   * --encode (default || fastest || balanced || smallest)\n");
+    fprintf(stderr, "   * --batch manifest.txt [--jobs N] [--image-cache MB]\n");
+    fprintf(stderr, "   * --shared-images DIR\n");
+    fprintf(stderr, "   * --stats stats.json\n");
+    fprintf(stderr, "   * --layers layers.txt [--jobs N] (lines of src.png mask.png xOffset yOffset [-FLAG])\n");
     exit(1);
   }
-  const char *srcfilename = argv[1];
-  const char *maskfilename = argv[2];
-  const char *destfilename = argv[3];
-  const char *outfilename = argv[4];
-  const int xOff = atoi(argv[5]);
-  const int yOff = atoi(argv[6]);
-
-  double extra1;
-  double extra2;
-  double extra3;
-
-  /* Read the src image */
-  Im src;
-  if (!src.read(srcfilename))
-  exit(1);
-
-  /* Read the dest image */
-  Im dest;
-  if (!dest.read(destfilename))
-  exit(1);
-
-  /* Read the dest image */
-  Im mask;
-  if (!mask.read(maskfilename))
-  exit(1);
 
-  printf("Read images of size %d x %d\n", dest.w(), dest.h());
-
-  // Enforce equality between dims of dest and mask
-  if (dest.h() != mask.h() && dest.w() != mask.w()) {
-    fprintf(stderr, "Usage: dest and mask images must have identical dimensions \n");
-    exit(1);
+  /* Run every line of a manifest, apply a patch, composite a list of layers,
+  *  or run the single operation on the command line */
+  if (batch) {
+    exit(runBatch(batch, opts, io, jobs, imageBudget) ? 1 : 0);
   }
-
-  // Flags
-  std::string d_short = "-d";
-  std::string d_long = "-direct";
-  std::string mono_short = "-mono";
-  std::string mono_long = "-monochrome";
-  std::string mx_short = "-mx";
-  std::string mx_long = "-mixed";
-  std::string f_short = "-f";
-  std::string f_long = "-flat";
-  std::string il_short = "-il";
-  std::string il_long = "-illumination";
-  std::string dec_short = "-dec";
-  std::string dec_long = "-decolor";
-  std::string rec_short = "-rec";
-  std::string rec_long = "-recolor";
-  std::string tex_short = "-tex";
-  std::string tex_long = "-texture";
-
-  // Use flag to determine cloning method
-  int error = 0;
-  if (argc == 8 && (d_short.compare(argv[7]) == 0 || d_long.compare(argv[7]) == 0)) {
-    // Apply direct cloning
-    error = direct_clone(src, mask, dest, xOff, yOff, outfilename);
-    if (error) exit(1);
-  } else if (argc == 8 && (mono_short.compare(argv[7]) == 0 || mono_long.compare(argv[7]) == 0)) {
-    // Convert src to monochrome and then apply poisson cloning
-    src = imToMonochrome(src);
-    int error = poisson_clone(src, mask, dest, xOff, yOff, outfilename, 0, extra1, extra2, extra3);
-    if (error) exit(1);
-  } else if (argc == 8 && (mx_short.compare(argv[7]) == 0 || mx_long.compare(argv[7]) == 0)) {
-    // Apply poisson cloning in mixed mode
-    int error = poisson_clone(src, mask, dest, xOff, yOff, outfilename, 1, extra1, extra2, extra3);
-    if (error) exit(1);
-  } else if (argc == 10 && (f_short.compare(argv[7]) == 0 || f_long.compare(argv[7]) == 0)) {
-    // Apply poisson cloning in flatten mode (only keep high gradients)
-    extra1 = atof(argv[8]);
-    extra2 = atof(argv[9]);
-    int error = poisson_clone(src, mask, dest, xOff, yOff, outfilename, 2, extra1, extra2, extra3);
-    if (error) exit(1);
-  } else if (argc == 10 && (il_short.compare(argv[7]) == 0 || il_long.compare(argv[7]) == 0)) {
-    // Apply poisson cloning with local illumination changes
-    extra1 = atof(argv[8]);
-    extra2 = atof(argv[9]);
-    int error = poisson_clone(src, mask, dest, xOff, yOff, outfilename, 3, extra1, extra2, extra3);
-    if (error) exit(1);
-  } else if (argc == 8 && (dec_short.compare(argv[7]) == 0 || dec_long.compare(argv[7]) == 0)) {
-    // Convert dest to monochrome and then apply poisson cloning
-    dest = imToMonochrome(dest);
-    int error = poisson_clone(src, mask, dest, xOff, yOff, outfilename, 0, extra1, extra2, extra3);
-    if (error) exit(1);
-  } else if (argc == 11 && (rec_short.compare(argv[7]) == 0 || rec_long.compare(argv[7]) == 0)) {
-    // Recolor souce and then apply poisson image blending
-    extra1 = atof(argv[8]);
-    extra2 = atof(argv[9]);
-    extra3 = atof(argv[9]);
-    src = imRecolor(src, extra1, extra2, extra3);
-    int error = poisson_clone(src, mask, dest, xOff, yOff, outfilename, 0, extra1, extra2, extra3);
-    if (error) exit(1);
-  } else if (argc == 9 && (tex_short.compare(argv[7]) == 0 || tex_long.compare(argv[7]) == 0)) {
-    // Apply poisson cloning but try to keep the grain (similar to mixed, but with threshholds)
-    extra1 = atof(argv[8]);
-    int error = poisson_clone(src, mask, dest, xOff, yOff, outfilename, 4, extra1, extra2, extra3);
-    if (error) exit(1);
-  } else {
-    // Apply Poisson seamless cloning
-    int error = poisson_clone(src, mask, dest, xOff, yOff, outfilename, 0, extra1, extra2, extra3);
-    if (error) exit(1);
+  if (apply) {
+    exit(runApply(apply, argv[1], argv[2], io.encode) ? 1 : 0);
   }
-
-  exit(0);
+  if (layers) {
+    exit(runLayers(layers, argv[1], argv[2], opts, jobs, imageBudget, io.encode, io.shared) ? 1 : 0);
+  }
+  ImageCache cache (imageBudget, io.shared);
+  exit(runJob(argc, argv, opts, io, io.shared.empty() ? NULL : &cache, true) ? 1 : 0);
 }
@@ -0,0 +1,246 @@
+/*
+spectral.cpp
+Direct O(N log N) Poisson solver for a rectangular Omega.
+
+Along an axis of n pixels the operator is tridiagonal with -1 off the
+diagonal and, on the diagonal, the number of neighbors along the axis that
+lie in the image.  Its eigenvectors phi_k are
+   DD: sin(pi (k+1) (j+1) / (n+1))       eigenvalue 2 - 2 cos(pi (k+1) / (n+1))
+   NN: cos(pi k (2j+1) / (2n))           eigenvalue 2 - 2 cos(pi k / n)
+   DN: sin(pi (2k+1) (j+1) / (2n+1))     eigenvalue 2 - 2 cos(pi (2k+1) / (2n+1))
+and ND is DN with the axis reversed.  Each transform is read off a zero padded
+complex FFT of length 2(n+1), 2n or 4n+2 respectively.  The 2D system is then
+solved by transforming rows and columns, dividing by the sum of the two
+eigenvalues and transforming back.
+*/
+
+#include <cmath>
+#include <algorithm>
+#include <gsl/gsl_errno.h>
+
+#include "spectral.h"
+
+SpectralAxis::SpectralAxis(int n_, SpectralAxisType type_) : n(n_), type(type_)
+{
+  eig.resize(n);
+  for (int k = 0; k < n; k++) {
+    double theta;
+    if (type == SPECTRAL_DD) {
+      theta = M_PI * (k + 1) / (n + 1);
+    } else if (type == SPECTRAL_NN) {
+      theta = M_PI * k / n;
+    } else {
+      theta = M_PI * (2 * k + 1) / (2 * n + 1);
+    }
+    eig[k] = (k == 0 && type == SPECTRAL_NN) ? 0.0 : 2.0 - 2.0 * cos(theta);
+  }
+
+  if (type == SPECTRAL_DD) {
+    M = 2 * (n + 1);
+  } else if (type == SPECTRAL_NN) {
+    M = 2 * n;
+  } else {
+    M = 4 * n + 2;
+  }
+  wavetable = gsl_fft_complex_wavetable_alloc(M);
+}
+
+SpectralAxis::~SpectralAxis()
+{
+  gsl_fft_complex_wavetable_free(wavetable);
+}
+
+void SpectralAxis::forward(const double *v, int vstride, double *c, int cstride,
+                           double *buf, gsl_fft_complex_workspace *work) const
+{
+  /* Zero padded copy of v, shifted by one for the sine transforms */
+  ::std::fill(buf, buf + 2 * M, 0.0);
+  int shift = (type == SPECTRAL_NN) ? 0 : 1;
+  for (int j = 0; j < n; j++) {
+    int src = (type == SPECTRAL_ND) ? n - 1 - j : j;
+    buf[2 * (j + shift)] = v[src * vstride];
+  }
+  gsl_fft_complex_forward(buf, 1, M, wavetable, work);
+
+  for (int k = 0; k < n; k++) {
+    if (type == SPECTRAL_DD) {
+      c[k * cstride] = -buf[2 * (k + 1) + 1];
+    } else if (type == SPECTRAL_NN) {
+      double a = M_PI * k / (2 * n);
+      c[k * cstride] = buf[2 * k] * cos(a) + buf[2 * k + 1] * sin(a);
+    } else {
+      c[k * cstride] = -buf[2 * (2 * k + 1) + 1];
+    }
+  }
+}
+
+void SpectralAxis::inverse(const double *c, int cstride, double *v, int vstride,
+                           double *buf, gsl_fft_complex_workspace *work) const
+{
+  ::std::fill(buf, buf + 2 * M, 0.0);
+  if (type == SPECTRAL_DD) {
+    /* The DST-I is its own inverse up to a factor of 2 / (n + 1) */
+    for (int k = 0; k < n; k++) {
+      buf[2 * (k + 1)] = c[k * cstride];
+    }
+    gsl_fft_complex_forward(buf, 1, M, wavetable, work);
+    for (int j = 0; j < n; j++) {
+      v[j * vstride] = -buf[2 * (j + 1) + 1] * 2.0 / (n + 1);
+    }
+  } else if (type == SPECTRAL_NN) {
+    for (int k = 0; k < n; k++) {
+      double d = c[k * cstride] / ((k == 0) ? n : 0.5 * n);
+      double a = M_PI * k / (2 * n);
+      buf[2 * k] = d * cos(a);
+      buf[2 * k + 1] = d * sin(a);
+    }
+    gsl_fft_complex_backward(buf, 1, M, wavetable, work);
+    for (int j = 0; j < n; j++) {
+      v[j * vstride] = buf[2 * j];
+    }
+  } else {
+    for (int k = 0; k < n; k++) {
+      buf[2 * (2 * k + 1)] = c[k * cstride] * 4.0 / (2 * n + 1);
+    }
+    gsl_fft_complex_backward(buf, 1, M, wavetable, work);
+    for (int j = 0; j < n; j++) {
+      int dst = (type == SPECTRAL_ND) ? n - 1 - j : j;
+      v[dst * vstride] = buf[2 * (j + 1) + 1];
+    }
+  }
+}
+
+bool Spectral::rectangular(const Stencil &A, int box[4])
+{
+  const ::std::vector<int> &toMask = A.pixels();
+  int W = A.width();
+  if (toMask.empty()) return false;
+
+  int x0 = W, y0 = A.height(), x1 = -1, y1 = -1;
+  for (size_t id = 0; id < toMask.size(); id++) {
+    int px = toMask[id] % W;
+    int py = toMask[id] / W;
+    x0 = ::std::min(x0, px);
+    x1 = ::std::max(x1, px);
+    y0 = ::std::min(y0, py);
+    y1 = ::std::max(y1, py);
+  }
+  box[0] = x0;
+  box[1] = y0;
+  box[2] = x1;
+  box[3] = y1;
+
+  /* Omega lies inside its bounding box, so it fills it iff the sizes agree */
+  return (long long) (x1 - x0 + 1) * (y1 - y0 + 1) == (long long) toMask.size();
+}
+
+/* Boundary conditions of an axis running from lo to hi in an image of the given size */
+static SpectralAxisType axisType(int lo, int hi, int size)
+{
+  bool lowDirichlet = lo > 0;
+  bool highDirichlet = hi < size - 1;
+  if (lowDirichlet && highDirichlet) return SPECTRAL_DD;
+  if (lowDirichlet) return SPECTRAL_DN;
+  if (highDirichlet) return SPECTRAL_ND;
+  return SPECTRAL_NN;
+}
+
+Spectral::Spectral(const Stencil &A_, const int box[4])
+  : A(A_), x0(box[0]), y0(box[1]),
+    xaxis(box[2] - box[0] + 1, axisType(box[0], box[2], A_.width())),
+    yaxis(box[3] - box[1] + 1, axisType(box[1], box[3], A_.height()))
+{}
+
+int Spectral::solve(gsl_vector *x, const gsl_vector *b, int nrhs)
+{
+  int K = nrhs;
+  int nx = xaxis.size();
+  int ny = yaxis.size();
+  int W = A.width();
+  const ::std::vector<int> &toOmega = A.omega();
+  ThreadPool *pool = A.threads();
+
+  /* Gather b onto the rectangle, row by row */
+  ::std::vector<double> g((size_t) nx * ny * K);
+  ::std::vector<double> sum(K, 0.0);
+  for (int j = 0; j < ny; j++) {
+    for (int i = 0; i < nx; i++) {
+      int id = toOmega[(y0 + j) * W + x0 + i];
+      for (int k = 0; k < K; k++) {
+        g[((size_t) j * nx + i) * K + k] = gsl_vector_get(b, id * K + k);
+        sum[k] += gsl_vector_get(x, id * K + k);
+      }
+    }
+  }
+
+  /* Rows, then columns, each chunk with its own FFT workspace */
+  parallelFor(pool, ny, 16, [&](int begin, int end) {
+    ::std::vector<double> buf(2 * xaxis.fftSize());
+    gsl_fft_complex_workspace *work = gsl_fft_complex_workspace_alloc(xaxis.fftSize());
+    for (int j = begin; j < end; j++) {
+      for (int k = 0; k < K; k++) {
+        double *row = &g[(size_t) j * nx * K + k];
+        xaxis.forward(row, K, row, K, &buf[0], work);
+      }
+    }
+    gsl_fft_complex_workspace_free(work);
+  });
+  parallelFor(pool, nx, 16, [&](int begin, int end) {
+    ::std::vector<double> buf(2 * yaxis.fftSize());
+    gsl_fft_complex_workspace *work = gsl_fft_complex_workspace_alloc(yaxis.fftSize());
+    for (int i = begin; i < end; i++) {
+      for (int k = 0; k < K; k++) {
+        double *column = &g[(size_t) i * K + k];
+        yaxis.forward(column, nx * K, column, nx * K, &buf[0], work);
+      }
+    }
+    gsl_fft_complex_workspace_free(work);
+  });
+
+  /* Divide by the eigenvalues; the constant mode of a singular system keeps
+  *  the sum of the initial guess, which is its coefficient */
+  for (int j = 0; j < ny; j++) {
+    for (int i = 0; i < nx; i++) {
+      double lambda = xaxis.eigenvalue(i) + yaxis.eigenvalue(j);
+      for (int k = 0; k < K; k++) {
+        double &coefficient = g[((size_t) j * nx + i) * K + k];
+        coefficient = (lambda == 0.0) ? sum[k] : coefficient / lambda;
+      }
+    }
+  }
+
+  parallelFor(pool, nx, 16, [&](int begin, int end) {
+    ::std::vector<double> buf(2 * yaxis.fftSize());
+    gsl_fft_complex_workspace *work = gsl_fft_complex_workspace_alloc(yaxis.fftSize());
+    for (int i = begin; i < end; i++) {
+      for (int k = 0; k < K; k++) {
+        double *column = &g[(size_t) i * K + k];
+        yaxis.inverse(column, nx * K, column, nx * K, &buf[0], work);
+      }
+    }
+    gsl_fft_complex_workspace_free(work);
+  });
+  parallelFor(pool, ny, 16, [&](int begin, int end) {
+    ::std::vector<double> buf(2 * xaxis.fftSize());
+    gsl_fft_complex_workspace *work = gsl_fft_complex_workspace_alloc(xaxis.fftSize());
+    for (int j = begin; j < end; j++) {
+      for (int k = 0; k < K; k++) {
+        double *row = &g[(size_t) j * nx * K + k];
+        xaxis.inverse(row, K, row, K, &buf[0], work);
+      }
+    }
+    gsl_fft_complex_workspace_free(work);
+  });
+
+  /* Scatter the solution */
+  for (int j = 0; j < ny; j++) {
+    for (int i = 0; i < nx; i++) {
+      int id = toOmega[(y0 + j) * W + x0 + i];
+      for (int k = 0; k < K; k++) {
+        gsl_vector_set(x, id * K + k, g[((size_t) j * nx + i) * K + k]);
+      }
+    }
+  }
+
+  return GSL_SUCCESS;
+}
@@ -0,0 +1,83 @@
+#ifndef SPECTRAL_H
+#define SPECTRAL_H
+/*
+spectral.h
+Direct O(N log N) Poisson solver for a rectangular Omega.  On a rectangle the
+5-point operator separates into a 1D operator per axis, and each of those is
+diagonalized by a sine or cosine transform that depends on whether the sides
+of the rectangle border dest pixels (Dirichlet) or the edge of the image
+(Neumann).  The transforms are computed with GSL's complex FFT.
+*/
+
+#include <vector>
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_fft_complex.h>
+
+#include "stencil.h"
+
+
+// Boundary conditions at the low and high ends of an axis
+enum SpectralAxisType {
+  SPECTRAL_DD,  // Dirichlet at both ends: DST-I
+  SPECTRAL_NN,  // Neumann at both ends: DCT-II
+  SPECTRAL_DN,  // Dirichlet at the low end, Neumann at the high end
+  SPECTRAL_ND   // Neumann at the low end, Dirichlet at the high end
+};
+
+// Sine or cosine transform that diagonalizes the 1D operator of one axis
+class SpectralAxis {
+public:
+  SpectralAxis(int n, SpectralAxisType type);
+  ~SpectralAxis();
+
+  int size() const
+    { return n; }
+
+  // Eigenvalue of mode k
+  double eigenvalue(int k) const
+    { return eig[k]; }
+
+  // Size of the complex FFT used, for allocating a workspace and buffer
+  int fftSize() const
+    { return M; }
+
+  // c_k = sum_j v_j phi_k(j), reading v and writing c with the given strides
+  void forward(const double *v, int vstride, double *c, int cstride,
+               double *buf, gsl_fft_complex_workspace *work) const;
+
+  // v_j = sum_k c_k phi_k(j) / |phi_k|^2, the inverse of forward
+  void inverse(const double *c, int cstride, double *v, int vstride,
+               double *buf, gsl_fft_complex_workspace *work) const;
+
+private:
+  int n, M;
+  SpectralAxisType type;
+  ::std::vector<double> eig;
+  gsl_fft_complex_wavetable *wavetable;
+
+  SpectralAxis(const SpectralAxis &);
+  SpectralAxis &operator=(const SpectralAxis &);
+};
+
+// Spectral solver for the Omega system when Omega is a rectangle
+class Spectral {
+public:
+  // True if Omega is exactly the rectangle x0..x1 by y0..y1, stored in box
+  static bool rectangular(const Stencil &A, int box[4]);
+
+  // Set up the transforms for the rectangle found by rectangular()
+  Spectral(const Stencil &A, const int box[4]);
+
+  // Solve Ax = b exactly for nrhs interleaved right-hand sides (entry
+  // id * nrhs + k).  If both axes are Neumann the system is singular; the
+  // solution then keeps the mean of the initial x, as CG would.
+  // Returns a GSL status code.
+  int solve(gsl_vector *x, const gsl_vector *b, int nrhs);
+
+private:
+  const Stencil &A;
+  int x0, y0;
+  SpectralAxis xaxis, yaxis;
+};
+
+#endif
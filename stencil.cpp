@@ -0,0 +1,137 @@
+/*
+stencil.cpp
+Matrix-free 5-point Laplacian over Omega.
+*/
+
+#include "stencil.h"
+
+// Number of set bits in a 4-bit neighbor mask
+const unsigned char Stencil::bits[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+// Omega pixels per chunk below which a product is not worth splitting
+static const int APPLY_GRAIN = 4096;
+
+Stencil::Stencil(const ::std::vector<int> &toOmega_, const ::std::vector<int> &toMask_, int W_, int H_,
+                 ThreadPool *pool_)
+  : toOmega(toOmega_), toMask(toMask_), W(W_), H(H_), pool(pool_)
+{
+  offset[STENCIL_NORTH] = -W;
+  offset[STENCIL_EAST] = 1;
+  offset[STENCIL_SOUTH] = W;
+  offset[STENCIL_WEST] = -1;
+
+  int OMEGA_SIZE = toMask.size();
+  code.assign(OMEGA_SIZE, 0);
+  for (int id = 0; id < OMEGA_SIZE; id++) {
+    int p = toMask[id];
+    int px = p % W;
+    int py = p / W;
+    bool inImage[4];
+    inImage[STENCIL_NORTH] = py > 0;
+    inImage[STENCIL_EAST] = px < W - 1;
+    inImage[STENCIL_SOUTH] = py < H - 1;
+    inImage[STENCIL_WEST] = px > 0;
+
+    unsigned char c = 0;
+    for (int dir = 0; dir < 4; dir++) {
+      if (!inImage[dir]) continue;
+      c |= 1 << dir;
+      if (toOmega[p + offset[dir]] != -1) c |= 16 << dir;
+    }
+    code[id] = c;
+  }
+}
+
+/* out = Av on rows [begin, end) for K interleaved vectors; K is a template
+* parameter so that the common cases unroll */
+template <int K, class Real>
+static void applyStencil(const unsigned char *code, const unsigned char *bits, const int *toOmega,
+                         const int *toMask, const int *offset, int begin, int end, int nrhs,
+                         const Real *v, Real *out)
+{
+  int k_count = K ? K : nrhs;
+  for (int id = begin; id < end; id++) {
+    unsigned char c = code[id];
+    int p = toMask[id];
+    int nb[4];
+    int count = 0;
+    for (int dir = 0; dir < 4; dir++) {
+      if (c & (16 << dir)) nb[count++] = toOmega[p + offset[dir]] * k_count;
+    }
+    for (int k = 0; k < k_count; k++) {
+      Real sum = bits[c & 15] * v[id * k_count + k];
+      for (int m = 0; m < count; m++) {
+        sum -= v[nb[m] + k];
+      }
+      out[id * k_count + k] = sum;
+    }
+  }
+}
+
+template <class Real>
+void Stencil::applyAll(const Real *v, Real *out, int nrhs) const
+{
+  if (size() == 0) return;
+  const unsigned char *c = &code[0];
+  const int *o = &toOmega[0];
+  const int *m = &toMask[0];
+  const int *off = offset;
+  parallelFor(pool, size(), APPLY_GRAIN, [=](int begin, int end) {
+    if (nrhs == 1) {
+      applyStencil<1>(c, bits, o, m, off, begin, end, nrhs, v, out);
+    } else if (nrhs == 3) {
+      applyStencil<3>(c, bits, o, m, off, begin, end, nrhs, v, out);
+    } else {
+      applyStencil<0>(c, bits, o, m, off, begin, end, nrhs, v, out);
+    }
+  });
+}
+
+void Stencil::apply(const double *v, double *out, int nrhs) const
+{
+  applyAll(v, out, nrhs);
+}
+
+void Stencil::apply(const float *v, float *out, int nrhs) const
+{
+  applyAll(v, out, nrhs);
+}
+
+gsl_spmatrix *Stencil::compress() const
+{
+  /* A is symmetric, so column id holds the entries of row id: the diagonal
+  *  and the neighbors in Omega.  IDs descend with the pixel index, so in
+  *  ascending row order these are south, east, id itself, west and north */
+  int OMEGA_SIZE = size();
+  ::std::vector<size_t> start (OMEGA_SIZE + 1, 0);
+  for (int id = 0; id < OMEGA_SIZE; id++) {
+    start[id + 1] = start[id] + 1 + bits[code[id] >> 4];
+  }
+  gsl_spmatrix *C = gsl_spmatrix_alloc_nzmax(OMEGA_SIZE, OMEGA_SIZE, start[OMEGA_SIZE], GSL_SPMATRIX_CCS);
+
+  /* Columns are filled in place, so ranges of them can be written in parallel */
+  parallelFor(pool, OMEGA_SIZE + 1, APPLY_GRAIN, [&](int begin, int end) {
+    for (int id = begin; id < end; id++) {
+      C->p[id] = start[id];
+      if (id == OMEGA_SIZE) break;
+
+      size_t k = start[id];
+      static const int lower[2] = { STENCIL_SOUTH, STENCIL_EAST };
+      static const int upper[2] = { STENCIL_WEST, STENCIL_NORTH };
+      for (int m = 0; m < 2; m++) {
+        if (status(id, lower[m]) != STENCIL_OMEGA) continue;
+        C->i[k] = neighbor(id, lower[m]);
+        C->data[k++] = -1.0;
+      }
+      C->i[k] = id;
+      C->data[k++] = (double) diag(id);
+      for (int m = 0; m < 2; m++) {
+        if (status(id, upper[m]) != STENCIL_OMEGA) continue;
+        C->i[k] = neighbor(id, upper[m]);
+        C->data[k++] = -1.0;
+      }
+    }
+  });
+  C->nz = start[OMEGA_SIZE];
+  return C;
+}
@@ -0,0 +1,103 @@
+#ifndef STENCIL_H
+#define STENCIL_H
+/*
+stencil.h
+Matrix-free 5-point Laplacian over Omega.  Instead of a sparse matrix, each
+pixel of Omega keeps a one byte code recording which of its cardinal
+neighbors lie in the image and which lie in Omega; the Omega IDs of the
+neighbors are looked up through the toOmega map on demand.
+*/
+
+#include <vector>
+#include <gsl/gsl_spmatrix.h>
+
+#include "threadpool.h"
+
+
+// Cardinal directions, in the order neighbors are visited
+enum { STENCIL_NORTH = 0, STENCIL_EAST = 1, STENCIL_SOUTH = 2, STENCIL_WEST = 3 };
+
+// Status of a neighbor q of a pixel in Omega
+enum {
+  STENCIL_OUTSIDE = -1,  // not in image
+  STENCIL_BOUNDARY = 0,  // in boundary of Omega
+  STENCIL_OMEGA = 1      // in Omega
+};
+
+// The Omega system Ax = b: Np on the diagonal, -1 between neighbors in Omega
+class Stencil {
+public:
+  // toOmega maps pixels of the W x H image to Omega IDs (-1 outside Omega) and
+  // toMask maps them back; both must outlive the stencil, as must pool, which
+  // (if set) runs products in parallel
+  Stencil(const ::std::vector<int> &toOmega, const ::std::vector<int> &toMask, int W, int H,
+          ThreadPool *pool = NULL);
+
+  // Number of unknowns
+  int size() const
+    { return (int) code.size(); }
+
+  // Image width and height
+  int width() const
+    { return W; }
+  int height() const
+    { return H; }
+
+  // Omega ID <-> pixel index maps
+  const ::std::vector<int> &omega() const
+    { return toOmega; }
+  const ::std::vector<int> &pixels() const
+    { return toMask; }
+
+  // Status of the neighbor of Omega pixel id in direction dir
+  int status(int id, int dir) const
+  {
+    if (code[id] & (16 << dir)) return STENCIL_OMEGA;
+    return (code[id] & (1 << dir)) ? STENCIL_BOUNDARY : STENCIL_OUTSIDE;
+  }
+
+  // Pixel index of the neighbor in direction dir (only valid inside the image)
+  int neighborPixel(int id, int dir) const
+    { return toMask[id] + offset[dir]; }
+
+  // Omega ID of the neighbor in direction dir (only valid for STENCIL_OMEGA)
+  int neighbor(int id, int dir) const
+    { return toOmega[toMask[id] + offset[dir]]; }
+
+  // Diagonal entry Np: the number of neighbors in the image
+  int diag(int id) const
+    { return bits[code[id] & 15]; }
+
+  // out = Av, for nrhs vectors interleaved as entry id * nrhs + k, in double
+  // or single precision
+  void apply(const double *v, double *out, int nrhs = 1) const;
+  void apply(const float *v, float *out, int nrhs = 1) const;
+
+  // Assemble A straight into compressed column format (caller frees)
+  gsl_spmatrix *compress() const;
+
+  // Worker threads shared by the solvers (NULL when single-threaded)
+  ThreadPool *threads() const
+    { return pool; }
+
+  // Bytes held by the stencil itself (the index maps belong to the caller)
+  size_t memory() const
+    { return code.size(); }
+
+private:
+  const ::std::vector<int> &toOmega;
+  const ::std::vector<int> &toMask;
+  int W, H;
+  int offset[4];
+  ThreadPool *pool;
+
+  // Per Omega pixel: bit dir set if that neighbor is in the image, bit 4 + dir
+  // set if it is in Omega
+  ::std::vector<unsigned char> code;
+
+  static const unsigned char bits[16];
+
+  template <class Real> void applyAll(const Real *v, Real *out, int nrhs) const;
+};
+
+#endif
@@ -0,0 +1,62 @@
+#!/bin/sh
+# tests/batch.sh
+# A --batch manifest whose lines clone into the output of earlier lines, as
+# the three layers of fig3b: each line must see the finished output of the one
+# before, so the result must match running the lines one at a time.
+#
+# Usage: tests/batch.sh
+# Run from the top of the repository after building poisson_clone (make test).
+
+BIN=./poisson_clone
+T=./test_images
+WORK=${TMPDIR:-/tmp}/poisson_test_batch
+
+if [ ! -x $BIN ]; then
+  echo "Build poisson_clone first (make)" >&2
+  exit 1
+fi
+rm -rf $WORK
+mkdir -p $WORK
+failures=0
+
+check() {
+  if [ "$2" = 0 ]; then
+    echo "ok: $1"
+  else
+    echo "FAILED: $1"
+    failures=$((failures + 1))
+  fi
+}
+
+# The layers one run at a time
+$BIN $T/perez-fig3b-src1-orig.png $T/perez-fig3b-mask1.png $T/perez-fig3b-dst.png $WORK/serial.png 33 24 \
+  --solver mg > /dev/null 2>&1
+$BIN $T/perez-fig3b-src2-orig.png $T/perez-fig3b-mask2.png $WORK/serial.png $WORK/serial.png 20 110 \
+  --solver mg > /dev/null 2>&1
+$BIN $T/perez-fig3b-src2-orig.png $T/perez-fig3b-mask3.png $WORK/serial.png $WORK/serial.png -67 98 \
+  --solver mg > /dev/null 2>&1
+
+# The same layers as lines of one manifest, with every stage free to run ahead
+for mode in "" --stream; do
+  cat > $WORK/jobs.txt <<END
+$T/perez-fig3b-src1-orig.png $T/perez-fig3b-mask1.png $T/perez-fig3b-dst.png $WORK/a.png 33 24
+$T/perez-fig3b-src2-orig.png $T/perez-fig3b-mask2.png $WORK/a.png $WORK/b.png 20 110
+$T/perez-fig3b-src2-orig.png $T/perez-fig3b-mask3.png $WORK/b.png $WORK/b.png -67 98
+END
+  rm -f $WORK/a.png $WORK/b.png
+  $BIN --batch $WORK/jobs.txt --jobs 3 --solver mg $mode > /dev/null 2>&1
+  status=$?
+  [ $status -eq 0 ] && cmp -s $WORK/serial.png $WORK/b.png
+  check "a chained manifest matches running its lines in turn ${mode:-without --stream}" $?
+done
+
+# A line that uses the output of a failed line fails as well
+cat > $WORK/jobs.txt <<END
+$T/perez-fig3b-src1-orig.png $WORK/missing.png $T/perez-fig3b-dst.png $WORK/c.png 33 24
+$T/perez-fig3b-src2-orig.png $T/perez-fig3b-mask2.png $WORK/c.png $WORK/d.png 20 110
+END
+$BIN --batch $WORK/jobs.txt --jobs 2 --solver mg > $WORK/log.txt 2>&1
+[ $? -ne 0 ] && grep -q "2 failed" $WORK/log.txt && [ ! -f $WORK/d.png ]
+check "a line using the output of a failed line fails" $?
+
+[ $failures -eq 0 ]
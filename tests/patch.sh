@@ -0,0 +1,65 @@
+#!/bin/sh
+# tests/patch.sh
+# Round trip of --patch and --apply: a patch applied to its dest must give the
+# same image as cloning into the whole dest, also when out is dest itself, and
+# a sidecar that places the patch outside dest must be rejected without
+# writing out.
+#
+# Usage: tests/patch.sh
+# Run from the top of the repository after building poisson_clone (make test).
+
+BIN=./poisson_clone
+T=./test_images
+WORK=${TMPDIR:-/tmp}/poisson_test_patch
+ARGS="$T/perez-fig4a-src-orig.png $T/perez-fig4a-mask.png $T/perez-fig4a-dst.png"
+
+if [ ! -x $BIN ]; then
+  echo "Build poisson_clone first (make)" >&2
+  exit 1
+fi
+rm -rf $WORK
+mkdir -p $WORK
+failures=0
+
+check() {
+  if [ "$2" = 0 ]; then
+    echo "ok: $1"
+  else
+    echo "FAILED: $1"
+    failures=$((failures + 1))
+  fi
+}
+
+# Clone into the whole dest, and into a patch that is then applied
+$BIN $ARGS $WORK/full.png -11 52 --solver mg > /dev/null 2>&1
+$BIN $ARGS $WORK/patch.png -11 52 --solver mg --patch > /dev/null 2>&1
+$BIN --apply $WORK/patch.png $T/perez-fig4a-dst.png $WORK/applied.png > /dev/null 2>&1
+cmp -s $WORK/full.png $WORK/applied.png
+check "patch applied to dest matches the full output" $?
+
+# Apply in place, out being dest
+cp $T/perez-fig4a-dst.png $WORK/dest.png
+$BIN --apply $WORK/patch.png $WORK/dest.png $WORK/dest.png > /dev/null 2>&1
+cmp -s $WORK/full.png $WORK/dest.png
+check "patch applied in place matches the full output" $?
+
+# Sidecars that place the patch partly or wholly outside dest
+cp $WORK/patch.png.patch $WORK/patch.good
+read left top width height W H < $WORK/patch.good
+for placement in "$((W - width + 1)) $top" "-1 $top" "$left $((H - height + 1))" "$left -1" "$W $H"; do
+  echo "$placement $width $height $W $H" > $WORK/patch.png.patch
+  rm -f $WORK/bad.png
+  $BIN --apply $WORK/patch.png $T/perez-fig4a-dst.png $WORK/bad.png > /dev/null 2>&1
+  status=$?
+  [ $status -ne 0 ] && [ ! -f $WORK/bad.png ]
+  check "patch placed at ($placement) is rejected" $?
+  cp $WORK/patch.good $WORK/patch.png.patch
+done
+
+# A truncated sidecar
+echo "$left $top $width" > $WORK/patch.png.patch
+$BIN --apply $WORK/patch.png $T/perez-fig4a-dst.png $WORK/bad.png > /dev/null 2>&1
+[ $? -ne 0 ] && [ ! -f $WORK/bad.png ]
+check "truncated sidecar is rejected" $?
+
+[ $failures -eq 0 ]
@@ -0,0 +1,73 @@
+/*
+threadpool.cpp
+A fixed set of worker threads for the data parallel loops of the solvers.
+*/
+
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int threads)
+  : nthreads(threads > 1 ? threads : 1), current(NULL), count(0), pending(0), generation(0), stop(false)
+{
+  for (int i = 1; i < nthreads; i++) {
+    workers.push_back(::std::thread(&ThreadPool::work, this, i));
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    ::std::lock_guard< ::std::mutex> guard(lock);
+    stop = true;
+  }
+  wake.notify_all();
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+}
+
+void ThreadPool::run(int count_, const ::std::function<void(int)> &task)
+{
+  if (count_ <= 0) return;
+  if (count_ > nthreads) count_ = nthreads;
+  {
+    ::std::lock_guard< ::std::mutex> guard(lock);
+    current = &task;
+    count = count_;
+    pending = count_ - 1;
+    generation++;
+  }
+  wake.notify_all();
+
+  /* The caller takes the first task */
+  task(0);
+
+  ::std::unique_lock< ::std::mutex> guard(lock);
+  while (pending > 0) {
+    finished.wait(guard);
+  }
+  current = NULL;
+}
+
+/* Worker index waits for each new batch and runs task(index) if there is one */
+void ThreadPool::work(int index)
+{
+  unsigned seen = 0;
+  for (;;) {
+    const ::std::function<void(int)> *task;
+    {
+      ::std::unique_lock< ::std::mutex> guard(lock);
+      while (!stop && generation == seen) {
+        wake.wait(guard);
+      }
+      if (stop) return;
+      seen = generation;
+      if (index >= count) continue;
+      task = current;
+    }
+
+    (*task)(index);
+
+    ::std::lock_guard< ::std::mutex> guard(lock);
+    if (--pending == 0) finished.notify_one();
+  }
+}
@@ -0,0 +1,83 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+/*
+threadpool.h
+A fixed set of worker threads for the data parallel loops of the solvers.
+Work is split into contiguous chunks, at most one per thread, so that the
+result of a reduction depends only on the number of chunks.
+*/
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+
+class ThreadPool {
+public:
+  // Start threads - 1 workers; the calling thread is the last one
+  explicit ThreadPool(int threads);
+  ~ThreadPool();
+
+  // Number of threads, including the caller
+  int size() const
+    { return nthreads; }
+
+  // Run task(i) for every i in [0, count), count <= size(), each on its own
+  // thread; returns once all of them have finished
+  void run(int count, const ::std::function<void(int)> &task);
+
+private:
+  int nthreads;
+  ::std::vector< ::std::thread> workers;
+  ::std::mutex lock;
+  ::std::condition_variable wake, finished;
+  const ::std::function<void(int)> *current;
+  int count, pending;
+  unsigned generation;
+  bool stop;
+
+  void work(int index);
+};
+
+
+/* Number of chunks a loop over n items is split into, given that a chunk
+* should have at least grain items (1 without a pool) */
+inline int chunkCount(const ThreadPool *pool, int n, int grain)
+{
+  if (pool == NULL) return 1;
+  int chunks = n / (grain > 0 ? grain : 1);
+  if (chunks > pool->size()) chunks = pool->size();
+  return chunks > 1 ? chunks : 1;
+}
+
+/* First item of chunk c when n items are split into the given number of chunks */
+inline int chunkBegin(int n, int chunks, int c)
+{
+  return (int) ((long long) n * c / chunks);
+}
+
+/* Call task(c) for every chunk c in [0, chunks), on the pool if there is more
+* than one */
+template <class Task>
+inline void runChunks(ThreadPool *pool, int chunks, const Task &task)
+{
+  if (chunks == 1) {
+    task(0);
+  } else {
+    pool->run(chunks, task);
+  }
+}
+
+/* Call body(begin, end) on chunks covering [0, n), in parallel if pool is
+* set and the loop is large enough */
+template <class Body>
+inline void parallelFor(ThreadPool *pool, int n, int grain, const Body &body)
+{
+  if (n <= 0) return;
+  int chunks = chunkCount(pool, n, grain);
+  runChunks(pool, chunks, [&](int c) { body(chunkBegin(n, chunks, c), chunkBegin(n, chunks, c + 1)); });
+}
+
+#endif
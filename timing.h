@@ -0,0 +1,32 @@
+#ifndef TIMING_H
+#define TIMING_H
+/*
+timing.h
+Wall clock and memory helpers for reporting solver performance.
+*/
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+
+/* Seconds since an arbitrary point in time */
+inline double wallTime()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6 * tv.tv_usec;
+}
+
+/* Peak resident set size of the process in kilobytes */
+inline long peakRSS()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;  // bytes on OS X
+#else
+  return usage.ru_maxrss;         // kilobytes on Linux
+#endif
+}
+
+#endif